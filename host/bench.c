@@ -0,0 +1,1039 @@
+// Host benchmark for the src/main.c handlers.
+//
+// The app, its worker and the phone come from harness.h. Each case prepares
+// the app state once, then calls the handler in a tight loop and reports the
+// wall time together with the heap and persist traffic the stub counted.
+// What the app does is checked by host/test.c, this only measures it.
+//
+//   ihm-bench [iterations] [case-name-prefix]
+//   ihm-bench --record trace-file   records the scenarios as a session trace
+//   ihm-bench --replay trace-file   replays a session trace, see replay.c
+//   ihm-bench --flood rate size [seconds]   floods the inbox, see flood()
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <pebble.h>
+#include "replay.h"
+
+// Traces are compiled in, and recorded only with --record
+static FILE *s_trace_file = NULL;
+
+static void bench_trace_write(const void *data, size_t size) {
+  fwrite(data, 1, size, s_trace_file);
+}
+
+#define TRACE_RECORD
+#define TRACE_SINK bench_trace_write
+#define TRACE_ENABLED() (s_trace_file != NULL)
+
+#include "harness.h"
+
+#define BENCH_DEFAULT_ITERATIONS 100000
+
+typedef struct {
+  const char *name;
+  void (*setup)(void);
+  void (*run)(void);
+  void (*teardown)(void);
+} BenchCase;
+
+static AccelData s_samples[ACCEL_BATCH_SIZE];
+
+static void setup_elevation(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_ELEVATION);
+  dict_write_int16(&iter, KEY_ALTITUDE, 495);
+  message_end(&iter);
+}
+
+static void setup_weather_status(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_WEATHER_STATUS);
+  dict_write_cstring(&iter, KEY_STATUS, "Clouds");
+  dict_write_cstring(&iter, KEY_DESCRIPTION, "broken clouds");
+  message_end(&iter);
+}
+
+static void setup_temperature(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_WEATHER_TEMPERATURE);
+  dict_write_int16(&iter, KEY_TEMPERATURE, 125);
+  message_end(&iter);
+}
+
+static void setup_wind(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_WEATHER_WIND);
+  dict_write_int16(&iter, KEY_WIND_SPEED, 140);
+  dict_write_int16(&iter, KEY_WIND_DIRECTION, 225);
+  message_end(&iter);
+}
+
+static void setup_sunrise(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_WEATHER_SUNRISE);
+  dict_write_uint32(&iter, KEY_SUNRISE, PHONE_SUNRISE);
+  message_end(&iter);
+}
+
+static void setup_transport(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_TRANSPORT);
+  dict_write_cstring(&iter, KEY_DEPARTURE, "Yverdon-les-Bains, Gare");
+  dict_write_uint32(&iter, KEY_DEPARTURE_TIME, PHONE_EPOCH + 300);
+  dict_write_cstring(&iter, KEY_ARRIVAL, "Lausanne");
+  dict_write_uint32(&iter, KEY_ARRIVAL_TIME, PHONE_EPOCH + 1620);
+  message_end(&iter);
+}
+
+// Station names far longer than the display, to check they are cut safely
+static void setup_transport_long(void) {
+  char station[200];
+  DictionaryIterator iter;
+  memset(station, 'x', sizeof(station) - 1);
+  station[sizeof(station) - 1] = '\0';
+  message_begin(&iter, REQUEST_TRANSPORT);
+  dict_write_cstring(&iter, KEY_DEPARTURE, station);
+  dict_write_uint32(&iter, KEY_DEPARTURE_TIME, PHONE_EPOCH + 300);
+  dict_write_cstring(&iter, KEY_ARRIVAL, station);
+  dict_write_uint32(&iter, KEY_ARRIVAL_TIME, PHONE_EPOCH + 1620);
+  message_end(&iter);
+}
+
+static void run_received(void) {
+  stub_inbox_deliver(s_message, s_message_size);
+}
+
+// Puts an item on the current screen, as if chosen in the config window
+static int s_saved_item = -1;
+
+static void show_item(int id) {
+  s_saved_item = s_config.screens[currentScreen];
+  screen_set_request(currentScreen, id);
+  main_show_screen();
+  ack_outbox();
+}
+
+static void restore_item(void) {
+  screen_set_request(currentScreen, s_saved_item);
+  main_show_screen();
+  ack_outbox();
+}
+
+// Stream running, then one delta frame delivered per call
+static void setup_navigation(void) {
+  show_item(REQUEST_START_THREADED_LOCATION);
+  nav_message(true, 0, 0);
+  stub_inbox_deliver(s_message, s_message_size);
+}
+
+static void run_navigation(void) {
+  nav_message(false, -3, 1);
+  stub_inbox_deliver(s_message, s_message_size);
+}
+
+// Target fixed on the watch and the phone moving, then the position worked
+// out again between two fixes per call
+static void setup_nav_position(void) {
+  DictionaryIterator iter;
+  s_target = (GeoPoint){ 46204400, 6143200 };
+  s_target_set = true;
+  show_item(REQUEST_START_THREADED_LOCATION);
+  for (int i = 0; i < 2; i++) {
+    message_begin(&iter, REQUEST_START_THREADED_LOCATION);
+    dict_write_int32(&iter, KEY_LATITUDE, 46519100 + i * 45);
+    dict_write_int32(&iter, KEY_LONGITUDE, 6632300 + i * 65);
+    message_end(&iter);
+    stub_inbox_deliver(s_message, s_message_size);
+    stub_advance_ms(NAV_FIX_INTERVAL_MS);
+  }
+}
+
+static void run_nav_position(void) {
+  nav_locate();
+}
+
+static void teardown_nav_position(void) {
+  restore_item();
+  s_target_set = false;
+}
+
+static void setup_up_time(void) {
+  show_item(SHOW_UP_TIME);
+}
+
+static void setup_battery(void) {
+  show_item(SHOW_BATTERY_STATE);
+}
+
+static void run_tick(void) {
+  stub_advance_ms(1000);
+  stub_tick(SECOND_UNIT);
+}
+
+static void run_battery(void) {
+  BatteryChargeState state = battery_state_service_peek();
+  state.charge_percent = state.charge_percent > 10 ? state.charge_percent - 1 : 100;
+  stub_battery_set(state);
+}
+
+// Wearer at rest (1g on z), with one sample out of `period` shaking
+static void fill_samples(int period) {
+  for (int i = 0; i < ACCEL_BATCH_SIZE; i++) {
+    int16_t swing = (period && i % period == 0) ? 1500 : 0;
+    s_samples[i] = (AccelData) { .x = swing, .y = -swing / 2, .z = -1000 };
+  }
+}
+
+static void setup_active_time(void) {
+  show_item(SHOW_ACTIVE_TIME);
+  fill_samples(2);
+}
+
+static void run_data(void) {
+  stub_accel_deliver(s_samples, stub_accel_samples_per_update());
+}
+
+static void run_up_main(void) {
+  stub_press(BUTTON_ID_UP);
+  phone_answer();
+}
+
+static void run_down_main(void) {
+  stub_press(BUTTON_ID_DOWN);
+  phone_answer();
+}
+
+static void setup_config(void) {
+  window_stack_push(config_window, false);
+}
+
+static void teardown_config(void) {
+  stub_press(BUTTON_ID_BACK);
+}
+
+static void run_up_config(void) {
+  stub_press(BUTTON_ID_UP);
+}
+
+static void run_down_config(void) {
+  stub_press(BUTTON_ID_DOWN);
+}
+
+static void run_select_config(void) {
+  stub_press(BUTTON_ID_SELECT);
+}
+
+static const BenchCase s_cases[] = {
+  { "received_handler/location",    setup_location,       run_received, NULL },
+  { "received_handler/location_text", setup_location_text, run_received, NULL },
+  { "received_handler/navigation",  setup_navigation,     run_navigation, restore_item },
+  { "nav_locate/dead_reckoning",    setup_nav_position,   run_nav_position, teardown_nav_position },
+  { "received_handler/elevation",   setup_elevation,      run_received, NULL },
+  { "received_handler/weather",     setup_weather_status, run_received, NULL },
+  { "received_handler/temperature", setup_temperature,    run_received, NULL },
+  { "received_handler/weather_all", setup_weather_all,    run_received, NULL },
+  { "received_handler/wind",        setup_wind,           run_received, NULL },
+  { "received_handler/sunrise",     setup_sunrise,        run_received, NULL },
+  { "received_handler/transport",   setup_transport,      run_received, NULL },
+  { "received_handler/transport_long", setup_transport_long, run_received, NULL },
+  { "received_handler/timetable",   transport_answer,     run_received, NULL },
+  { "tick_handler/up_time",         setup_up_time,        run_tick,     restore_item },
+  { "battery_handler",              setup_battery,        run_battery,  restore_item },
+  { "accel_handler/active_time",    setup_active_time,    run_data,     restore_item },
+  { "up_main_click_handler",        NULL,                 run_up_main,  NULL },
+  { "down_main_click_handler",      NULL,                 run_down_main, NULL },
+  { "up_click_config_handler",      setup_config,         run_up_config, teardown_config },
+  { "down_click_config_handler",    setup_config,         run_down_config, teardown_config },
+  { "config_click_handler",         setup_config,         run_select_config, teardown_config },
+};
+
+static unsigned long s_hour_redraws, s_hour_worker_wakeups;
+
+// Wakeups over one simulated hour with the item on screen, the wearer
+// moving with the given sample pattern. The screen is drawn once a second,
+// the redraws it needed are left in s_hour_redraws and the wakeups of the
+// worker in s_hour_worker_wakeups.
+static unsigned long wakeups_per_hour(int id, int period) {
+  uint32_t accel_ms = 0;
+  show_item(id);
+  fill_samples(period);
+  stub_reset_stats();
+  for (int second = 0; second < 3600; second++) {
+    stub_advance_ms(1000);
+    stub_tick(SECOND_UNIT);
+    accel_ms += 1000;
+    while (stub_accel_subscribed()) {
+      uint32_t samples = stub_accel_samples_per_update();
+      uint32_t batch_ms = samples * 1000 / stub_accel_sampling_rate();
+      if (accel_ms < batch_ms) {
+        break;
+      }
+      accel_ms -= batch_ms;
+      stub_accel_deliver(s_samples, samples);
+    }
+    stub_render();
+  }
+  unsigned long wakeups = stub_stats.wakeups;
+  s_hour_redraws = stub_stats.redraws;
+  s_hour_worker_wakeups = stub_stats.worker_wakeups;
+  restore_item();
+  return wakeups;
+}
+
+// Presses up `presses` times faster than the phone answers, with every
+// other message failing once, and counts what reaches the phone
+static void rapid_switching(int presses) {
+  int first_screen = currentScreen;
+  stub_reset_stats();
+  for (int i = 0; i < presses; i++) {
+    stub_press(BUTTON_ID_UP);
+  }
+  for (int round = 0; round < 100; round++) {
+    if (stub_outbox_pending()) {
+      stub_outbox_complete(round % 2 ? APP_MSG_SEND_TIMEOUT : APP_MSG_OK);
+    }
+    stub_advance_ms(1000);
+  }
+  printf("rapid switching: %d presses, %u sends, %u busy outbox\n",
+         presses, stub_stats.outbox_sends, stub_stats.outbox_busy);
+  while (currentScreen != first_screen) {
+    stub_press(BUTTON_ID_UP);
+    ack_outbox();
+  }
+}
+
+// Cycles through four weather screens with the phone answering, and counts
+// the messages sent
+static void weather_round_trips(int presses) {
+  int8_t saved[NUMBER_OF_SCREENS];
+  memcpy(saved, s_config.screens, sizeof(saved));
+  screen_set_request(0, REQUEST_WEATHER_STATUS);
+  screen_set_request(1, REQUEST_WEATHER_TEMPERATURE);
+  screen_set_request(2, REQUEST_WEATHER_WIND);
+  screen_set_request(3, REQUEST_WEATHER_SUNSET);
+  stub_reset_stats();
+  for (int i = 0; i < presses; i++) {
+    stub_press(BUTTON_ID_UP);
+    phone_answer();
+    stub_advance_ms(5000);
+  }
+  printf("weather screens: %d switches, %u sends\n", presses, stub_stats.outbox_sends);
+  memcpy(s_config.screens, saved, sizeof(saved));
+}
+
+// Cycles through the screens once every answer has gone stale, the phone
+// answering in between, and counts the switches that found no fresh answer
+// and had to ask the phone while the user waits
+static void neighbour_prefetch(int presses) {
+  int waits = 0;
+  stub_advance_ms(24 * 3600 * 1000);
+  main_show_screen();
+  phone_answer();
+  stub_reset_stats();
+  for (int i = 0; i < presses; i++) {
+    unsigned sends = stub_stats.outbox_sends;
+    stub_press(BUTTON_ID_UP);
+    if (stub_stats.outbox_sends != sends) {
+      waits++;
+    }
+    phone_answer();
+    stub_advance_ms(5000);
+  }
+  printf("stale screens: %d switches, %d waited for the phone, %u sends\n",
+         presses, waits, stub_stats.outbox_sends);
+}
+
+// Phone streaming navigation frames every period_ms for 10 s with the
+// screen shown, then the user moving to another screen
+static void nav_stream(uint32_t period_ms) {
+  show_item(REQUEST_START_THREADED_LOCATION);
+  nav_message(true, 0, 0);
+  stub_inbox_deliver(s_message, s_message_size);
+  stub_render();
+  stub_reset_stats();
+  for (uint32_t ms = 0; ms < 10000; ms += period_ms) {
+    nav_message(false, -1, 0);
+    stub_inbox_deliver(s_message, s_message_size);
+    stub_advance_ms(period_ms);
+    stub_render();
+  }
+  unsigned long redraws = stub_stats.redraws;
+  uint16_t frame_size = s_message_size;
+  restore_item();
+  printf("navigation stream: %u frames in 10 s, %lu redraws, %u bytes per frame, %s after leaving\n",
+         10000 / period_ms, redraws, frame_size,
+         s_nav_timer == NULL && s_running_service != SERVICE_NAV ? "stopped" : "running");
+}
+
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Ways of known length and initial bearing, from the haversine in double
+typedef struct {
+  GeoPoint from;
+  GeoPoint to;
+  double distance;      // m
+  double bearing;       // degrees
+} GeoWay;
+
+static const GeoWay s_geo_ways[] = {
+  { { 46519100, 6632300 }, { 46204400, 6143200 }, 51313.8, 227.18 },
+  { { 46519100, 6632300 }, { 46519500, 6632800 }, 58.7, 40.70 },
+  { { 48856600, 2352200 }, { 51507400, -127800 }, 343556.1, 330.02 },
+  { { -17000000, 179900000 }, { -17100000, -179900000 }, 23993.7, 117.64 },   // Across 180°
+  { { 89000000, 0 }, { 89000000, 90000000 }, 157249.4, 45.00 },
+  { { -33868800, 151209300 }, { 40712800, -74006000 }, 15988755.5, 65.60 },
+};
+
+#define GEO_WAYS (sizeof(s_geo_ways) / sizeof(s_geo_ways[0]))
+
+static double bench_abs(double value) {
+  return value < 0 ? -value : value;
+}
+
+// Integer haversine against the reference, and what it costs
+static void geo_accuracy(void) {
+  double worst_m = 0, worst_ratio = 0, worst_bearing = 0;
+  int32_t distance;
+  int16_t bearing;
+  for (size_t i = 0; i < GEO_WAYS; i++) {
+    const GeoWay *way = &s_geo_ways[i];
+    geo_distance_bearing(&way->from, &way->to, &distance, &bearing);
+    double error = bench_abs(distance - way->distance);
+    double bearing_error = bench_abs(bearing - way->bearing);
+    if (way->distance < 1000 && error > worst_m) {
+      worst_m = error;
+    } else if (way->distance >= 1000 && error / way->distance > worst_ratio) {
+      worst_ratio = error / way->distance;
+    }
+    if (bearing_error > worst_bearing) {
+      worst_bearing = bearing_error;
+    }
+  }
+  uint64_t start = clock_ns();
+  for (int i = 0; i < 100000; i++) {
+    geo_distance_bearing(&s_geo_ways[i % GEO_WAYS].from, &s_geo_ways[i % GEO_WAYS].to, &distance, &bearing);
+  }
+  double ns = (double)(clock_ns() - start) / 100000;
+  printf("geo: %u ways, distance within %.1f m under 1 km and %.4f %% beyond, bearing within %.2f deg, %.1f ns per way\n",
+         (unsigned)GEO_WAYS, worst_m, worst_ratio * 100, worst_bearing, ns);
+}
+
+// Sunrise and sunset of the NOAA solar calculator, in local s of the day
+typedef struct {
+  GeoPoint position;
+  uint32_t day;
+  int32_t utc_offset;
+  int32_t rise;
+  int32_t set;
+} SunDay;
+
+static const SunDay s_sun_days[] = {
+  { { 46519100, 6632300 }, 16436, 3600, 29845, 60993 },       // Lausanne, 2015-01-01
+  { { 46519100, 6632300 }, 16607, 7200, 20422, 77402 },       // Lausanne, 2015-06-21
+  { { 48856600, 2352200 }, 16514, 3600, 24864, 68566 },       // Paris, 2015-03-20
+  { { 40712800, -74006000 }, 16740, -18000, 23160, 60757 },   // New York, 2015-11-01
+  { { -33868800, 151209300 }, 16450, 39600, 21553, 72546 },   // Sydney, 2015-01-15
+  { { -180700, -78467800 }, 16701, -18000, 21783, 65372 },    // Quito, 2015-09-23
+  { { 35676200, 139650300 }, 16790, 32400, 24411, 59485 },    // Tokyo, 2015-12-21
+  { { 69649200, 18955300 }, 16535, 7200, 18511, 73529 },      // Tromsø, 2015-04-10
+};
+
+#define SUN_DAYS (sizeof(s_sun_days) / sizeof(s_sun_days[0]))
+
+static void sun_accuracy(void) {
+  int32_t worst = 0, worst_polar = 0;
+  time_t rise, set;
+  for (size_t i = 0; i < SUN_DAYS; i++) {
+    const SunDay *sun = &s_sun_days[i];
+    int32_t error = 0;
+    if (sun_times(&sun->position, sun->day, &rise, &set)) {
+      int32_t midnight = sun->day * 86400 - sun->utc_offset;
+      error = abs((int32_t)(rise - midnight) - sun->rise);
+      if (abs((int32_t)(set - midnight) - sun->set) > error) {
+        error = abs((int32_t)(set - midnight) - sun->set);
+      }
+    } else {
+      error = 86400;
+    }
+    if (abs(sun->position.lat) > 66560000) {
+      worst_polar = error > worst_polar ? error : worst_polar;
+    } else {
+      worst = error > worst ? error : worst;
+    }
+  }
+  uint64_t start = clock_ns();
+  for (int i = 0; i < 100000; i++) {
+    sun_times(&s_sun_days[i % SUN_DAYS].position, s_sun_days[i % SUN_DAYS].day, &rise, &set);
+  }
+  printf("sun: %u days, within %ld s of NOAA (%ld s above the polar circle), %.1f ns per day\n",
+         (unsigned)SUN_DAYS, (long)worst, (long)worst_polar, (double)(clock_ns() - start) / 100000);
+}
+
+// Sunrise screen from a fresh install : asked with the weather until the
+// position and the offset of local time are known, then worked out every
+// day on the watch over 30 days
+static void sun_screens(void) {
+  memset(&s_sun, 0, sizeof(s_sun));
+  s_sun_day = 0;
+  s_position_known = false;
+  while (stub_outbox_pending()) {
+    ack_outbox();
+  }
+  stub_reset_stats();
+  int fallback = 0;
+  s_weather_time = 0;
+  show_item(REQUEST_WEATHER_SUNRISE);
+  fallback += stub_stats.outbox_sends;
+  setup_weather_all();
+  stub_inbox_deliver(s_message, s_message_size);
+  setup_location();
+  stub_inbox_deliver(s_message, s_message_size);
+  s_weather_time = 0;
+  restore_item();
+  stub_reset_stats();
+  show_item(REQUEST_WEATHER_SUNRISE);
+  fallback += stub_stats.outbox_sends;
+  setup_weather_all();
+  stub_inbox_deliver(s_message, s_message_size);
+  char phone[WEATHER_FIELD_SIZE];
+  strcpy(phone, s_weather[KEY_SUNRISE - KEY_STATUS]);
+  restore_item();
+
+  stub_reset_stats();
+  char first[WEATHER_FIELD_SIZE] = "";
+  unsigned sends = 0;
+  for (int day = 0; day < 30; day++) {
+    stub_advance_ms(86400 * 1000);
+    unsigned before = stub_stats.outbox_sends;
+    show_item(day % 2 ? REQUEST_WEATHER_SUNSET : REQUEST_WEATHER_SUNRISE);
+    sends += stub_stats.outbox_sends - before;
+    if (day == 0) {
+      strcpy(first, s_weather[KEY_SUNRISE - KEY_STATUS]);
+    }
+    restore_item();
+  }
+  printf("sun screens: %d sends until located, then %u over 30 days, %u persist writes, sunrise %s the next day (phone %s)\n",
+         fallback, sends, stub_stats.persist_writes, first, phone);
+}
+
+// Target fixed on the watch, the phone then sending its positions every
+// NAV_FIX_INTERVAL_MS for 60 s of walking at 1.4 m/s, the screen following
+// the walker between fixes
+static void nav_positions(void) {
+  DictionaryIterator iter;
+  GeoPoint target = { 46522000, 6632300 };
+  message_begin(&iter, REQUEST_FIX_LOCATION);
+  dict_write_int32(&iter, KEY_LATITUDE, target.lat);
+  dict_write_int32(&iter, KEY_LONGITUDE, target.lon);
+  message_end(&iter);
+  stub_inbox_deliver(s_message, s_message_size);
+
+  // The start asks for positions, less often
+  while (stub_outbox_pending()) {
+    ack_outbox();
+  }
+  s_saved_item = s_config.screens[currentScreen];
+  screen_set_request(currentScreen, REQUEST_START_THREADED_LOCATION);
+  main_show_screen();
+  uint16_t size;
+  const uint8_t *data = stub_outbox_data(&size);
+  Tuple *interval = dict_read_begin_from_buffer(&iter, data, size) ? dict_find(&iter, KEY_NAV_INTERVAL) : NULL;
+  bool positions = dict_find(&iter, KEY_NAV_POSITIONS) != NULL;
+  ack_outbox();
+  stub_render();
+  stub_reset_stats();
+
+  int fixes = 0;
+  int32_t worst = 0, worst_held = 0;
+  uint16_t fix_size = 0;
+  GeoPoint fix = { 0, 0 };
+  for (uint32_t ms = 0; ms < 60000; ms += 100) {
+    GeoPoint walker = { 46519100 + (int32_t)(9 * ms / 1000), 6632300 + (int32_t)(13 * ms / 1000) };
+    if (ms % NAV_FIX_INTERVAL_MS == 0) {
+      fix = walker;
+      message_begin(&iter, REQUEST_START_THREADED_LOCATION);
+      dict_write_int32(&iter, KEY_LATITUDE, fix.lat);
+      dict_write_int32(&iter, KEY_LONGITUDE, fix.lon);
+      message_end(&iter);
+      stub_inbox_deliver(s_message, s_message_size);
+      fix_size = s_message_size;
+      fixes++;
+    }
+    stub_advance_ms(100);
+    stub_render();
+    // Once the speed is known, against the walker and the last fix held
+    if (fixes >= 2) {
+      int32_t distance, held;
+      int16_t bearing;
+      geo_distance_bearing(&walker, &target, &distance, &bearing);
+      geo_distance_bearing(&fix, &target, &held, &bearing);
+      if (abs(s_nav.distance - distance) > worst) {
+        worst = abs(s_nav.distance - distance);
+      }
+      if (abs(held - distance) > worst_held) {
+        worst_held = abs(held - distance);
+      }
+    }
+  }
+  unsigned long redraws = stub_stats.redraws;
+  restore_item();
+  s_target_set = false;
+  persist_delete(PERSIST_TARGET);
+  nav_message(false, 0, 0);
+  printf("navigation positions: %s every %u ms, %d fixes in 60 s, %lu redraws, %u bytes per fix "
+         "(%.1f B/s, frames of the phone %.1f B/s), within %ld m of the walker (%ld m on the last fix)\n",
+         positions ? "asked" : "not asked", interval ? (unsigned)tuple_int(interval) : 0, fixes, redraws,
+         fix_size, fix_size * 1000.0 / NAV_FIX_INTERVAL_MS, s_message_size * 1000.0 / NAV_INTERVAL_MS,
+         (long)worst, (long)worst_held);
+}
+
+// Transport on screen for 3 h with the phone answering, what it sends for a
+// timetable and for one connection per answer
+static unsigned transport_hours(bool single, char *shown) {
+  s_transport_single = single;
+  s_timetable.count = 0;
+  while (stub_outbox_pending()) {
+    ack_outbox();
+  }
+  s_saved_item = s_config.screens[currentScreen];
+  screen_set_request(currentScreen, REQUEST_TRANSPORT);
+  main_show_screen();
+  phone_answer();
+  stub_reset_stats();
+  for (int second = 0; second < 3 * 3600; second++) {
+    stub_advance_ms(1000);
+    stub_tick(SECOND_UNIT);
+    phone_answer();
+    stub_render();
+  }
+  strcpy(shown, shown_text());
+  unsigned sends = stub_stats.outbox_sends;
+  restore_item();
+  s_transport_single = false;
+  return sends;
+}
+
+static void transport_timetable(void) {
+  char shown[MAX_TEXT_SIZE], single_shown[MAX_TEXT_SIZE];
+  unsigned sends = transport_hours(false, shown);
+  unsigned long redraws = stub_stats.redraws;
+  unsigned single = transport_hours(true, single_shown);
+  for (char *c = shown; *c; c++) {
+    *c = *c == '\n' ? '|' : *c;
+  }
+  printf("transport for 3 h: %u sends with %d connections per answer, %u with one, %lu redraws, \"%s\"\n",
+         sends, TIMETABLE_SIZE, single, redraws, shown);
+}
+
+// Grows to MAX_SCREENS screens of phone items, cycles through them all
+// with the phone answering, and shrinks back
+static void many_screens(void) {
+  int num_screens = s_config.num_screens;
+  int8_t saved[MAX_SCREENS];
+  memcpy(saved, s_config.screens, sizeof(saved));
+  stub_reset_stats();
+  screens_resize(MAX_SCREENS);
+  for (int i = 0; i < MAX_SCREENS; i++) {
+    screen_set_request(i, i % 2 ? REQUEST_LOCATION : REQUEST_ELEVATION);
+  }
+  for (int i = 0; i < MAX_SCREENS; i++) {
+    stub_press(BUTTON_ID_UP);
+    phone_answer();
+  }
+  printf("%d screens: %d switches, %u sends, %u allocs\n",
+         MAX_SCREENS, MAX_SCREENS, stub_stats.outbox_sends, stub_stats.allocs);
+  screens_resize(num_screens);
+  memcpy(s_config.screens, saved, sizeof(saved));
+}
+
+// Opens the menu from the main window, the config of the first screen and
+// the diagnostics, and back to the main window, `visits` times over
+static void menu_visits(int visits) {
+  int screen = currentScreen;
+  size_t heap = heap_bytes_used();
+  stub_reset_stats();
+  for (int i = 0; i < visits; i++) {
+    stub_press(BUTTON_ID_SELECT);
+    stub_press(BUTTON_ID_SELECT);
+    stub_press(BUTTON_ID_BACK);
+    for (int row = 0; row < num_rows_callback(s_menu_layer, 0, NULL); row++) {
+      stub_press(BUTTON_ID_DOWN);
+    }
+    stub_press(BUTTON_ID_SELECT);
+    stub_press(BUTTON_ID_BACK);
+    stub_press(BUTTON_ID_BACK);
+    phone_answer();
+  }
+  printf("menu: %d visits, %d windows deep at the end, %u allocs, heap %+ld bytes\n",
+         visits, stub_window_stack_depth(), stub_stats.allocs, (long)heap_bytes_used() - (long)heap);
+  currentScreen = screen;
+  main_show_screen();
+  phone_answer();
+}
+
+// Phone answering the location in 50 to 1475 ms and the weather in 800 ms,
+// with one failure, one dropped message and one answer that never comes,
+// then the diagnostics window and the dump the phone asks for
+static void round_trip_stats(void) {
+  phone_answer();
+  memset(&s_stats, 0, sizeof(s_stats));
+  for (int i = 0; i < 20; i++) {
+    outbox_push(REQUEST_LOCATION);
+    stub_advance_ms(50 + 75 * i);
+    phone_answer();
+    outbox_push(REQUEST_WEATHER_ALL);
+    stub_advance_ms(800);
+    phone_answer();
+  }
+  outbox_push(REQUEST_ELEVATION);
+  stub_outbox_complete(APP_MSG_SEND_TIMEOUT);
+  stub_advance_ms(OUTBOX_RETRY_MS);
+  phone_answer();
+  stub_inbox_drop(APP_MSG_BUFFER_OVERFLOW);
+  outbox_push(REQUEST_TRANSPORT);
+  ack_outbox();
+  stub_advance_ms(STATS_TIMEOUT_MS);
+
+  window_stack_push(s_diag_window, false);
+  printf("diagnostics:\n%s\n", s_diag_text);
+  window_stack_pop(false);
+
+  DictionaryIterator iter;
+  dict_write_begin(&iter, s_message, sizeof(s_message));
+  dict_write_uint8(&iter, KEY_STATS, 0);
+  message_end(&iter);
+  stub_inbox_deliver(s_message, s_message_size);
+  uint16_t size = 0;
+  const uint8_t *data = stub_outbox_data(&size);
+  Tuple *tuple = data ? dict_read_begin_from_buffer(&iter, data, size) : NULL;
+  printf("stats dump: %u bytes for %u types\n", tuple ? tuple->length : 0,
+         tuple ? (tuple->length - STATS_HEADER_SIZE) / (1 + 2 * STATS_BUCKETS) : 0);
+  ack_outbox();
+}
+
+// A week of wear with the worker sampling as on the watch : a 15 minute
+// walk every hour from 7h to 23h, still otherwise. Checks the day totals
+// against the minute records and reports what the history keeps.
+static void activity_week(void) {
+  uint32_t accel_ms = 0;
+  stub_reset_stats();
+  for (int minute = 0; minute < 7 * 24 * 60; minute++) {
+    int hour = time(NULL) / 3600 % 24;
+    fill_samples(hour >= 7 && hour < 23 && time(NULL) / 60 % 60 < 15 ? 2 : 0);
+    for (accel_ms += 60000; stub_accel_subscribed(); ) {
+      uint32_t samples = stub_accel_samples_per_update();
+      uint32_t batch_ms = samples * 1000 / stub_accel_sampling_rate();
+      if (accel_ms < batch_ms) {
+        break;
+      }
+      accel_ms -= batch_ms;
+      stub_advance_ms(batch_ms);
+      stub_accel_deliver(s_samples, samples);
+    }
+  }
+  uint32_t today = time(NULL) / (24 * 60 * 60);
+  uint32_t first = history_first_minute();
+  int days_checked = 0, days_matching = 0;
+  uint32_t week = 0;
+  for (uint32_t day = today - 6; day <= today; day++) {
+    week += history_day_seconds(day);
+    if (day * 24 * 60 >= first) {
+      days_checked++;
+      days_matching += history_range_seconds(day * 24 * 60, (day + 1) * 24 * 60) == history_day_seconds(day);
+    }
+  }
+  printf("activity week: %lu min active, %lu bytes of minutes back %.1f days, "
+         "%d/%d days match their minutes, %u persist writes\n",
+         (unsigned long)week / 60, (unsigned long)history_size(), (time(NULL) / 60 - first) / (24 * 60.0),
+         days_matching, days_checked, stub_stats.persist_writes);
+}
+
+// A few minutes of use made only of events, the way a trace records them :
+// a press every 5 s, the phone answering, ticks and motion every second
+static void record_session(int seconds) {
+  fill_samples(2);
+  for (int second = 0; second < seconds; second++) {
+    if (second % 5 == 0) {
+      stub_press(second % 60 < 40 ? BUTTON_ID_UP : BUTTON_ID_DOWN);
+    }
+    phone_answer();
+    stub_advance_ms(1000);
+    stub_tick(SECOND_UNIT);
+    if (stub_accel_subscribed()) {
+      stub_accel_deliver(s_samples, stub_accel_samples_per_update());
+    }
+  }
+}
+
+// Inbox flood : a stand-in for the phone answers every request in turn at a
+// fixed rate, padded to the size asked, one in FLOOD_MALFORMED_EVERY with
+// keys left out or sent as another type. A handler runs about
+// FLOOD_WATCH_SLOWDOWN times slower on the watch than here, a redraw takes
+// FLOOD_REDRAW_US there, and what comes while the app is still busy is
+// dropped, as the firmware does.
+#define FLOOD_WATCH_SLOWDOWN  50      // Desktop core against the 64 MHz watch, roughly
+#define FLOOD_REDRAW_US       8000    // A screen of text on the watch, roughly
+#define FLOOD_MALFORMED_EVERY 4
+#define FLOOD_PAD_KEY         999     // Unknown to the app
+#define FLOOD_TUPLE_HEADER    7       // Key, type and length
+#define FLOOD_BUFFER_SIZE     (INBOX_SIZE + 64)
+#define FLOOD_MAX_MESSAGES    100000
+
+static uint32_t s_flood_random = 1;
+static uint8_t s_flood_pad[FLOOD_BUFFER_SIZE];
+
+static uint32_t flood_random(void) {
+  s_flood_random ^= s_flood_random << 13;
+  s_flood_random ^= s_flood_random >> 17;
+  s_flood_random ^= s_flood_random << 5;
+  return s_flood_random;
+}
+
+// Writes a tuple as it is, text included whether terminated or not
+static void flood_write(DictionaryIterator *out, uint32_t key, TupleType type, const void *data, uint16_t length) {
+  Tuple *written = out->cursor;
+  if (dict_write_data(out, key, data, length) == DICT_OK) {
+    written->type = type;
+  }
+}
+
+// The answer in s_message, its keys changed when malformed, in buffer after
+// the padding so that the last key ends where the message does
+static uint16_t flood_message(uint8_t *buffer, uint16_t size, bool malformed) {
+  static const uint8_t odd[3] = { 1, 2, 3 };
+  uint8_t changed[FLOOD_BUFFER_SIZE];
+  DictionaryIterator in, out;
+  dict_write_begin(&out, changed, sizeof(changed));
+  for (Tuple *tuple = dict_read_begin_from_buffer(&in, s_message, s_message_size); tuple;
+       tuple = dict_read_next(&in)) {
+    switch (malformed ? flood_random() % 5 : 4) {
+      case 0:   // Left out
+        break;
+      case 1:   // Text, unterminated
+        flood_write(&out, tuple->key, TUPLE_CSTRING, "xyz", 3);
+        break;
+      case 2:   // Byte array of an odd length
+        dict_write_data(&out, tuple->key, odd, sizeof(odd));
+        break;
+      case 3:   // Narrower integer
+        dict_write_uint8(&out, tuple->key, flood_random());
+        break;
+      default:
+        flood_write(&out, tuple->key, tuple->type, tuple->value->data, tuple->length);
+    }
+  }
+  uint32_t length = dict_write_end(&out);
+
+  dict_write_begin(&out, buffer, FLOOD_BUFFER_SIZE);
+  if (size >= length + FLOOD_TUPLE_HEADER) {
+    dict_write_data(&out, FLOOD_PAD_KEY, s_flood_pad, size - length - FLOOD_TUPLE_HEADER);
+  }
+  for (Tuple *tuple = length > 1 ? dict_read_begin_from_buffer(&in, changed, length) : NULL; tuple;
+       tuple = dict_read_next(&in)) {
+    flood_write(&out, tuple->key, tuple->type, tuple->value->data, tuple->length);
+  }
+  return dict_write_end(&out);
+}
+
+static int compare_uint32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Sends `rate` messages a second of `size` bytes for `seconds`, the phone
+// acknowledging what the app sends without answering it, and reports what
+// the app kept up with and the time its handler took
+static void flood(uint32_t rate, uint16_t size, uint32_t seconds) {
+  static uint8_t buffer[FLOOD_BUFFER_SIZE];
+  static uint32_t latencies[FLOOD_MAX_MESSAGES];
+  rate = rate ? rate : 1;
+  size = size < FLOOD_BUFFER_SIZE ? size : FLOOD_BUFFER_SIZE;
+  uint32_t messages = rate * seconds < FLOOD_MAX_MESSAGES ? rate * seconds : FLOOD_MAX_MESSAGES;
+  uint32_t handled = 0, busy = 0, too_large = 0, malformed = 0;
+  uint32_t dropped = s_stats.dropped;
+  uint64_t bytes = 0, busy_until_us = 0;
+  uint64_t start_ms = stub_now_ms();
+
+  for (uint32_t i = 0; i < messages; i++) {
+    uint64_t at_us = (uint64_t)i * 1000000 / rate;
+    uint64_t now_ms = stub_now_ms() - start_ms;
+    if (at_us / 1000 > now_ms) {
+      stub_advance_ms(at_us / 1000 - now_ms);
+    }
+    bool broken = i % FLOOD_MALFORMED_EVERY == FLOOD_MALFORMED_EVERY - 1;
+    phone_reply(i % (REQUEST_WEATHER_ALL + 1));
+    uint16_t length = flood_message(buffer, size, broken);
+    if (at_us < busy_until_us) {
+      stub_inbox_drop(APP_MSG_BUSY);
+      busy++;
+      continue;
+    }
+    if (length > INBOX_SIZE) {
+      stub_inbox_deliver(buffer, length);
+      too_large++;
+      continue;
+    }
+    uint32_t redraws = stub_stats.redraws;
+    uint64_t start = clock_ns();
+    stub_inbox_deliver(buffer, length);
+    stub_render();
+    uint32_t elapsed = clock_ns() - start;
+    while (stub_outbox_pending()) {
+      stub_outbox_complete(APP_MSG_OK);
+    }
+    latencies[handled++] = elapsed;
+    bytes += length;
+    malformed += broken;
+    busy_until_us = at_us + (uint64_t)elapsed * FLOOD_WATCH_SLOWDOWN / 1000 +
+                    (stub_stats.redraws - redraws) * FLOOD_REDRAW_US;
+  }
+
+  qsort(latencies, handled, sizeof(latencies[0]), compare_uint32);
+  uint32_t span_ms = (uint64_t)messages * 1000 / rate;
+  span_ms = span_ms ? span_ms : 1;
+  printf("flood %u msg/s of %u bytes for %u s: %u sent, %u handled (%.1f msg/s, %.1f KB/s, %u malformed), "
+         "dropped %u busy and %u too large (app counted %u), handler p50 %u ns, p90 %u, p99 %u, max %u\n",
+         rate, size, seconds, messages, handled, handled * 1000.0 / span_ms, bytes / 1.024 / span_ms, malformed,
+         busy, too_large, s_stats.dropped - dropped,
+         handled ? latencies[handled / 2] : 0, handled ? latencies[handled * 9 / 10] : 0,
+         handled ? latencies[handled * 99 / 100] : 0, handled ? latencies[handled - 1] : 0);
+  main_show_screen();
+  phone_answer();
+}
+
+static void bench_run(const BenchCase *bench, unsigned long iterations) {
+  if (bench->setup) {
+    bench->setup();
+  }
+  // One warm-up call so first-time lazy work is not billed to the loop
+  bench->run();
+  stub_reset_stats();
+
+  uint64_t start = clock_ns();
+  for (unsigned long i = 0; i < iterations; i++) {
+    bench->run();
+  }
+  uint64_t elapsed = clock_ns() - start;
+
+  double n = (double)iterations;
+  printf("%-32s %10.1f %8.3f %8.3f %8.3f %8.3f\n", bench->name,
+         (double)elapsed / n,
+         stub_stats.allocs / n,
+         stub_stats.persist_reads / n,
+         stub_stats.persist_writes / n,
+         stub_stats.outbox_sends / n);
+
+  if (bench->teardown) {
+    bench->teardown();
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+    stub_reset();
+    return replay_run(argv[2], &(ReplayHooks) { init, shown_text });
+  }
+  bool record = argc > 2 && strcmp(argv[1], "--record") == 0;
+  if (record && !(s_trace_file = fopen(argv[2], "wb"))) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  bool flooding = argc > 3 && strcmp(argv[1], "--flood") == 0;
+  unsigned long iterations = argc > 1 && !record ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_ITERATIONS;
+  const char *filter = argc > 2 && !record ? argv[2] : NULL;
+  if (iterations == 0) {
+    iterations = BENCH_DEFAULT_ITERATIONS;
+  }
+
+  // A typical set-up : two phone-backed screens, one local and one transport,
+  // saved by a version that used one key per screen
+  stub_reset();
+  stub_worker_set(worker_init, worker_deinit);
+  persist_write_int(PERSIST_SCREEN1, REQUEST_LOCATION);
+  persist_write_int(PERSIST_SCREEN2, REQUEST_WEATHER_TEMPERATURE);
+  persist_write_int(PERSIST_SCREEN3, record ? SHOW_ACTIVE_TIME : SHOW_UP_TIME);
+  persist_write_int(PERSIST_SCREEN4, REQUEST_TRANSPORT);
+
+  stub_reset_stats();
+  init();
+  ack_outbox();
+  printf("init: %u allocs, %u persist reads, %u persist writes, heap %lu bytes\n",
+         stub_stats.allocs, stub_stats.persist_reads, stub_stats.persist_writes,
+         (unsigned long)heap_bytes_used());
+  // The worker starts once the app is back in its event loop
+  stub_advance_ms(0);
+  // Next launch, the configuration is already migrated
+  stub_reset_stats();
+  config_load();
+  printf("config reload: %u persist reads, %u persist writes\n\n",
+         stub_stats.persist_reads, stub_stats.persist_writes);
+
+  if (flooding) {
+    flood(strtoul(argv[2], NULL, 10), strtoul(argv[3], NULL, 10), argc > 4 ? strtoul(argv[4], NULL, 10) : 10);
+    deinit();
+    return 0;
+  }
+  if (!record) {
+    printf("%-32s %10s %8s %8s %8s %8s\n", "handler", "ns/call", "allocs", "p.reads", "p.writes", "sends");
+  }
+  for (size_t i = 0; i < sizeof(s_cases) / sizeof(s_cases[0]) && !record; i++) {
+    if (filter && strncmp(s_cases[i].name, filter, strlen(filter)) != 0) {
+      continue;
+    }
+    bench_run(&s_cases[i], iterations);
+  }
+
+  if (record) {
+    record_session(300);
+  } else if (!filter) {
+    printf("\nwakeups/hour: location %lu, up time %lu, battery %lu, active time still %lu, moving %lu\n",
+           wakeups_per_hour(REQUEST_LOCATION, 0), wakeups_per_hour(SHOW_UP_TIME, 0),
+           wakeups_per_hour(SHOW_BATTERY_STATE, 0), wakeups_per_hour(SHOW_ACTIVE_TIME, 0),
+           wakeups_per_hour(SHOW_ACTIVE_TIME, 2));
+    wakeups_per_hour(SHOW_ACTIVE_TIME, 0);
+    unsigned long still = s_hour_worker_wakeups;
+    wakeups_per_hour(SHOW_ACTIVE_TIME, 2);
+    printf("worker wakeups/hour: still %lu, moving %lu\n", still, s_hour_worker_wakeups);
+    printf("redraws/hour:");
+    const int shown[] = { REQUEST_LOCATION, SHOW_UP_TIME, SHOW_BATTERY_STATE, SHOW_ACTIVE_TIME };
+    for (size_t i = 0; i < sizeof(shown) / sizeof(shown[0]); i++) {
+      wakeups_per_hour(shown[i], 0);
+      printf(" %s %lu%s", s_requests[shown[i]].label, s_hour_redraws, i + 1 < sizeof(shown) / sizeof(shown[0]) ? "," : "\n");
+    }
+    rapid_switching(8);
+    weather_round_trips(12);
+    neighbour_prefetch(8);
+    nav_stream(100);
+    geo_accuracy();
+    nav_positions();
+    sun_accuracy();
+    sun_screens();
+    transport_timetable();
+    many_screens();
+    menu_visits(100);
+    round_trip_stats();
+    activity_week();
+    flood(10, 64, 60);
+    flood(200, 256, 10);
+    flood(1000, INBOX_SIZE, 2);
+    flood(50, INBOX_SIZE + 1, 1);
+  }
+
+#ifdef PROFILE
+  // Built with -DPROFILE, the counts of the whole run are logged at exit
+  stub_set_log_enabled(true);
+#endif
+  deinit();
+  if (s_trace_file) {
+    fclose(s_trace_file);
+    printf("\nrecorded %s, final screen: \"%s\"\n", argv[2], shown_text());
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+// The app and its worker under test, compiled into the host program that
+// includes this, so their static handlers and globals are reachable, and a
+// stand-in for the companion app on the phone. Included once per program,
+// after whatever the program defines for the trace (src/trace.h).
+
+#include <pebble.h>
+
+#define main ihm_app_main
+#include "main.c"
+#undef main
+
+#define main ihm_worker_main
+#include "../worker_src/worker.c"
+#include "../worker_src/history.c"
+#undef main
+
+#define PHONE_BUFFER_SIZE 256
+
+static uint8_t s_message[PHONE_BUFFER_SIZE];
+static uint16_t s_message_size;
+
+// Messages as the companion app sends them
+static void message_begin(DictionaryIterator *iter, int request) {
+  dict_write_begin(iter, s_message, sizeof(s_message));
+  dict_write_int32(iter, PEBBLE_KEY_VALUE, request);
+}
+
+static void message_end(DictionaryIterator *iter) {
+  s_message_size = (uint16_t)dict_write_end(iter);
+}
+
+// 1 h past the stub clock origin, as the phone sends times
+#define PHONE_EPOCH 1420074000
+#define PHONE_SUNRISE (PHONE_EPOCH - 3600 + 29845)   // Lausanne, 08:17 and 16:56
+#define PHONE_SUNSET  (PHONE_EPOCH - 3600 + 60993)
+
+static void setup_location(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_LOCATION);
+  dict_write_int32(&iter, KEY_LATITUDE, 46519100);
+  dict_write_int32(&iter, KEY_LONGITUDE, 6632300);
+  message_end(&iter);
+}
+
+// Same answer from a companion app that still sends text
+static void setup_location_text(void) {
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_LOCATION);
+  dict_write_cstring(&iter, KEY_LATITUDE, "46.519100");
+  dict_write_cstring(&iter, KEY_LONGITUDE, "6.632300");
+  message_end(&iter);
+}
+
+// Navigation frame, with the absolute values for a keyframe
+static uint8_t s_nav_seq;
+
+static void nav_message(bool keyframe, int16_t distance_delta, int8_t bearing_delta) {
+  uint8_t delta[4] = { keyframe ? 0 : ++s_nav_seq, distance_delta & 0xFF,
+                       (uint16_t)distance_delta >> 8, (uint8_t)bearing_delta };
+  DictionaryIterator iter;
+  if (keyframe) {
+    s_nav_seq = 0;
+  }
+  message_begin(&iter, REQUEST_START_THREADED_LOCATION);
+  dict_write_data(&iter, KEY_NAV_DELTA, delta, sizeof(delta));
+  if (keyframe) {
+    dict_write_int32(&iter, KEY_DISTANCE, 1234);
+    dict_write_int16(&iter, KEY_DIRECTION, 45);
+  }
+  message_end(&iter);
+}
+
+static void pack_int32(uint8_t *data, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data[i] = (uint32_t)value >> (8 * i);
+  }
+}
+
+static void setup_weather_all(void) {
+  // KEY_TEMPERATURE to KEY_SUNSET
+  const int32_t fields[] = { 125, 1015, 71, 140, 225, PHONE_SUNRISE, PHONE_SUNSET };
+  uint8_t packed[sizeof(fields)];
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    pack_int32(packed + 4 * i, fields[i]);
+  }
+  DictionaryIterator iter;
+  message_begin(&iter, REQUEST_WEATHER_ALL);
+  dict_write_cstring(&iter, KEY_STATUS, "Clouds");
+  dict_write_cstring(&iter, KEY_DESCRIPTION, "broken clouds");
+  dict_write_data(&iter, KEY_WEATHER_DATA, packed, sizeof(packed));
+  message_end(&iter);
+}
+
+// Timetable of a companion app asked for connections, every 15 min from
+// the next quarter of an hour, or only the first one from an older app
+static bool s_transport_single = false;
+
+static void transport_answer(void) {
+  DictionaryIterator iter;
+  uint8_t table[TIMETABLE_SIZE * 8];
+  uint32_t first = (time(NULL) / 900 + 1) * 900;
+  for (int i = 0; i < TIMETABLE_SIZE; i++) {
+    pack_int32(table + 8 * i, first + i * 900);
+    pack_int32(table + 8 * i + 4, first + i * 900 + 1320);
+  }
+  message_begin(&iter, REQUEST_TRANSPORT);
+  dict_write_cstring(&iter, KEY_DEPARTURE, "Yverdon-les-Bains, Gare");
+  dict_write_cstring(&iter, KEY_ARRIVAL, "Lausanne");
+  if (s_transport_single) {
+    dict_write_uint32(&iter, KEY_DEPARTURE_TIME, first);
+    dict_write_uint32(&iter, KEY_ARRIVAL_TIME, first + 1320);
+  } else {
+    dict_write_data(&iter, KEY_TIMETABLE, table, sizeof(table));
+  }
+  message_end(&iter);
+}
+
+// Answer of the companion app to a request, the canned values of the
+// setup_* functions where there is one
+static void phone_reply(int request) {
+  DictionaryIterator iter;
+  const RequestInfo *info = request_get(request);
+  if (request == REQUEST_WEATHER_ALL) {
+    setup_weather_all();
+    return;
+  }
+  if (request == REQUEST_START_THREADED_LOCATION) {
+    nav_message(true, 0, 0);
+    return;
+  }
+  if (request == REQUEST_TRANSPORT) {
+    transport_answer();
+    return;
+  }
+  message_begin(&iter, request);
+  for (int i = 0; info && i < info->num_keys; i++) {
+    if (value_type(info->keys[i]) == VALUE_TEXT) {
+      dict_write_cstring(&iter, info->keys[i], "42");
+    } else {
+      dict_write_int32(&iter, info->keys[i], 42);
+    }
+  }
+  message_end(&iter);
+}
+
+// Acknowledges and answers everything the app sent
+static void phone_answer(void) {
+  while (stub_outbox_pending()) {
+    uint16_t size;
+    const uint8_t *data = stub_outbox_data(&size);
+    DictionaryIterator iter;
+    Tuple *tuple = dict_read_begin_from_buffer(&iter, data, size);
+    int request = tuple ? (int)tuple->key : -1;
+    stub_outbox_complete(APP_MSG_OK);
+    if (request >= 0) {
+      phone_reply(request);
+      stub_inbox_deliver(s_message, s_message_size);
+    }
+  }
+}
+
+static void ack_outbox(void) {
+  if (stub_outbox_pending()) {
+    stub_outbox_complete(APP_MSG_OK);
+  }
+}
+
+static const char *shown_text(void) {
+  return ((OutputData *)layer_get_data(output_layer))->text;
+}
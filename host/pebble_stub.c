@@ -0,0 +1,1290 @@
+// Memory-backed implementation of host/pebble.h.
+//
+// The behaviour follows the SDK 2 firmware closely enough for the handlers in
+// src/ : windows load on push and unload on pop, text layers mark themselves
+// dirty, AppMessage has a single outbox that stays busy until the driver acks
+// it, persistent storage is a small key/value table with the SDK size limits.
+
+#define _POSIX_C_SOURCE 199309L
+#define PEBBLE_STUB_INTERNAL
+
+#include "pebble.h"
+
+#include <stdarg.h>
+
+#define STUB_HEAP_SIZE        24576
+#define STUB_INBOX_MAX        2026
+#define STUB_OUTBOX_MAX       656
+#define STUB_MAX_WINDOWS      8
+#define STUB_MAX_TIMERS       16
+#define STUB_PERSIST_KEYS     64
+#define STUB_PERSIST_BUDGET   4096
+#define STUB_ACCEL_MAX_BATCH  25
+#define STUB_EPOCH_MS         1420070400000ULL // 2015-01-01 00:00:00 UTC
+
+#define TUPLE_HEADER_SIZE     (sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t))
+
+StubStats stub_stats;
+
+static bool s_log_enabled = false;
+
+// ---------------------------------------------------------------------------
+// Heap
+// ---------------------------------------------------------------------------
+
+typedef union {
+  size_t size;
+  long double align;
+} HeapHeader;
+
+static size_t s_heap_used = 0;
+
+void *stub_malloc(size_t size) {
+  if (s_heap_used + size > STUB_HEAP_SIZE) {
+    return NULL;
+  }
+  HeapHeader *header = malloc(sizeof(HeapHeader) + size);
+  if (!header) {
+    return NULL;
+  }
+  header->size = size;
+  s_heap_used += size;
+  stub_stats.allocs++;
+  return header + 1;
+}
+
+void *stub_calloc(size_t count, size_t size) {
+  void *ptr = stub_malloc(count * size);
+  if (ptr) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
+
+void stub_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  HeapHeader *header = (HeapHeader *)ptr - 1;
+  s_heap_used -= header->size;
+  stub_stats.frees++;
+  free(header);
+}
+
+size_t heap_bytes_used(void) {
+  return s_heap_used;
+}
+
+size_t heap_bytes_free(void) {
+  return STUB_HEAP_SIZE - s_heap_used;
+}
+
+// ---------------------------------------------------------------------------
+// Logging
+// ---------------------------------------------------------------------------
+
+void stub_log(uint8_t level, const char *file, int line, const char *fmt, ...) {
+  if (!s_log_enabled) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "[%3u] %s:%d ", level, file, line);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+void stub_set_log_enabled(bool enabled) {
+  s_log_enabled = enabled;
+}
+
+// ---------------------------------------------------------------------------
+// Clock and timers
+// ---------------------------------------------------------------------------
+
+struct AppTimer {
+  bool active;
+  uint64_t due_ms;
+  AppTimerCallback callback;
+  void *data;
+};
+
+static uint64_t s_now_ms = STUB_EPOCH_MS;
+static AppTimer s_timers[STUB_MAX_TIMERS];
+
+uint64_t stub_now_ms(void) {
+  return s_now_ms;
+}
+
+void stub_set_time_ms(uint64_t now_ms) {
+  s_now_ms = now_ms;
+}
+
+time_t stub_time(time_t *tloc) {
+  time_t now = (time_t)(s_now_ms / 1000);
+  if (tloc) {
+    *tloc = now;
+  }
+  return now;
+}
+
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms) {
+  uint16_t ms = (uint16_t)(s_now_ms % 1000);
+  stub_time(tloc);
+  if (out_ms) {
+    *out_ms = ms;
+  }
+  return ms;
+}
+
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data) {
+  for (int i = 0; i < STUB_MAX_TIMERS; i++) {
+    if (!s_timers[i].active) {
+      s_timers[i] = (AppTimer) {
+        .active = true,
+        .due_ms = s_now_ms + timeout_ms,
+        .callback = callback,
+        .data = callback_data,
+      };
+      return &s_timers[i];
+    }
+  }
+  return NULL;
+}
+
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms) {
+  if (!timer_handle || !timer_handle->active) {
+    return false;
+  }
+  timer_handle->due_ms = s_now_ms + new_timeout_ms;
+  return true;
+}
+
+void app_timer_cancel(AppTimer *timer_handle) {
+  if (timer_handle) {
+    timer_handle->active = false;
+  }
+}
+
+static void stub_worker_start(void);
+
+void stub_advance_ms(uint32_t ms) {
+  stub_worker_start();
+  uint64_t target = s_now_ms + ms;
+  for (;;) {
+    AppTimer *next = NULL;
+    for (int i = 0; i < STUB_MAX_TIMERS; i++) {
+      if (s_timers[i].active && s_timers[i].due_ms <= target &&
+          (!next || s_timers[i].due_ms < next->due_ms)) {
+        next = &s_timers[i];
+      }
+    }
+    if (!next) {
+      break;
+    }
+    if (next->due_ms > s_now_ms) {
+      s_now_ms = next->due_ms;
+    }
+    next->active = false;
+    stub_stats.wakeups++;
+    next->callback(next->data);
+  }
+  s_now_ms = target;
+}
+
+// ---------------------------------------------------------------------------
+// Graphics and layers
+// ---------------------------------------------------------------------------
+
+struct Layer {
+  GRect frame;
+  Layer *parent;
+  Layer *first_child;
+  Layer *next_sibling;
+  LayerUpdateProc update_proc;
+  bool hidden;
+  bool dirty;
+  void *data;
+};
+
+struct TextLayer {
+  Layer layer;
+  const char *text;
+  GColor text_color;
+  GColor background_color;
+  GTextAlignment alignment;
+  GFont font;
+};
+
+struct MenuLayer {
+  Layer layer;
+  MenuLayerCallbacks callbacks;
+  void *context;
+  MenuIndex selection;
+};
+
+struct Window {
+  Layer root;
+  WindowHandlers handlers;
+  ClickConfigProvider click_config_provider;
+  ClickHandler clicks[NUM_BUTTONS];
+  MenuLayer *menu;
+  GColor background_color;
+  bool loaded;
+};
+
+struct GContext {
+  GColor fill_color;
+  GColor text_color;
+};
+
+static GContext s_gcontext;
+static char s_font;
+
+GFont fonts_get_system_font(const char *font_key) {
+  return (GFont)&s_font;
+}
+
+void graphics_context_set_fill_color(GContext *ctx, GColor color) {
+  ctx->fill_color = color;
+}
+
+void graphics_context_set_text_color(GContext *ctx, GColor color) {
+  ctx->text_color = color;
+}
+
+void graphics_fill_rect(GContext *ctx, GRect rect, uint16_t corner_radius, GCornerMask corner_mask) {}
+
+void graphics_draw_text(GContext *ctx, const char *text, GFont const font, const GRect box,
+                        const GTextOverflowMode overflow_mode, const GTextAlignment alignment,
+                        const GTextLayoutCacheRef layout) {}
+
+static void layer_init(Layer *layer, GRect frame) {
+  memset(layer, 0, sizeof(*layer));
+  layer->frame = frame;
+  layer->dirty = true;
+}
+
+static Layer *layer_root(Layer *layer) {
+  while (layer->parent) {
+    layer = layer->parent;
+  }
+  return layer;
+}
+
+Layer *layer_create(GRect frame) {
+  Layer *layer = stub_malloc(sizeof(Layer));
+  if (layer) {
+    layer_init(layer, frame);
+  }
+  return layer;
+}
+
+Layer *layer_create_with_data(GRect frame, size_t data_size) {
+  Layer *layer = stub_malloc(sizeof(Layer) + data_size);
+  if (layer) {
+    layer_init(layer, frame);
+    layer->data = layer + 1;
+    memset(layer->data, 0, data_size);
+  }
+  return layer;
+}
+
+void layer_remove_from_parent(Layer *child) {
+  if (!child || !child->parent) {
+    return;
+  }
+  Layer **link = &child->parent->first_child;
+  while (*link && *link != child) {
+    link = &(*link)->next_sibling;
+  }
+  if (*link) {
+    *link = child->next_sibling;
+  }
+  layer_root(child)->dirty = true;
+  child->parent = NULL;
+  child->next_sibling = NULL;
+}
+
+void layer_destroy(Layer *layer) {
+  if (layer) {
+    layer_remove_from_parent(layer);
+    stub_free(layer);
+  }
+}
+
+void *layer_get_data(const Layer *layer) {
+  return layer->data;
+}
+
+void layer_set_update_proc(Layer *layer, LayerUpdateProc update_proc) {
+  layer->update_proc = update_proc;
+}
+
+void layer_mark_dirty(Layer *layer) {
+  layer->dirty = true;
+  layer_root(layer)->dirty = true;
+}
+
+void layer_add_child(Layer *parent, Layer *child) {
+  layer_remove_from_parent(child);
+  Layer **link = &parent->first_child;
+  while (*link) {
+    link = &(*link)->next_sibling;
+  }
+  *link = child;
+  child->parent = parent;
+  layer_mark_dirty(parent);
+}
+
+GRect layer_get_bounds(const Layer *layer) {
+  return GRect(0, 0, layer->frame.size.w, layer->frame.size.h);
+}
+
+GRect layer_get_frame(const Layer *layer) {
+  return layer->frame;
+}
+
+void layer_set_hidden(Layer *layer, bool hidden) {
+  if (layer->hidden != hidden) {
+    layer->hidden = hidden;
+    layer_mark_dirty(layer);
+  }
+}
+
+bool layer_get_hidden(const Layer *layer) {
+  return layer->hidden;
+}
+
+TextLayer *text_layer_create(GRect frame) {
+  TextLayer *text_layer = stub_malloc(sizeof(TextLayer));
+  if (text_layer) {
+    layer_init(&text_layer->layer, frame);
+    text_layer->text = NULL;
+    text_layer->text_color = GColorBlack;
+    text_layer->background_color = GColorWhite;
+    text_layer->alignment = GTextAlignmentLeft;
+    text_layer->font = NULL;
+  }
+  return text_layer;
+}
+
+void text_layer_destroy(TextLayer *text_layer) {
+  layer_destroy((Layer *)text_layer);
+}
+
+Layer *text_layer_get_layer(TextLayer *text_layer) {
+  return &text_layer->layer;
+}
+
+void text_layer_set_text(TextLayer *text_layer, const char *text) {
+  stub_stats.text_updates++;
+  text_layer->text = text;
+  layer_mark_dirty(&text_layer->layer);
+}
+
+const char *text_layer_get_text(TextLayer *text_layer) {
+  return text_layer->text;
+}
+
+void text_layer_set_background_color(TextLayer *text_layer, GColor color) {
+  text_layer->background_color = color;
+  layer_mark_dirty(&text_layer->layer);
+}
+
+void text_layer_set_text_color(TextLayer *text_layer, GColor color) {
+  text_layer->text_color = color;
+  layer_mark_dirty(&text_layer->layer);
+}
+
+void text_layer_set_text_alignment(TextLayer *text_layer, GTextAlignment text_alignment) {
+  text_layer->alignment = text_alignment;
+  layer_mark_dirty(&text_layer->layer);
+}
+
+void text_layer_set_font(TextLayer *text_layer, GFont font) {
+  text_layer->font = font;
+  layer_mark_dirty(&text_layer->layer);
+}
+
+// ---------------------------------------------------------------------------
+// Windows, clicks and menus
+// ---------------------------------------------------------------------------
+
+static Window *s_stack[STUB_MAX_WINDOWS];
+static int s_stack_depth = 0;
+static Window *s_configuring = NULL;
+
+static void window_configure_clicks(Window *window) {
+  memset(window->clicks, 0, sizeof(window->clicks));
+  if (window->click_config_provider) {
+    s_configuring = window;
+    window->click_config_provider(NULL);
+    s_configuring = NULL;
+  }
+}
+
+void window_single_click_subscribe(ButtonId button_id, ClickHandler handler) {
+  if (s_configuring) {
+    s_configuring->clicks[button_id] = handler;
+  }
+}
+
+Window *window_create(void) {
+  Window *window = stub_calloc(1, sizeof(Window));
+  if (window) {
+    layer_init(&window->root, GRect(0, 0, 144, 152)); // SDK 2 : 168px minus status bar
+    window->background_color = GColorWhite;
+  }
+  return window;
+}
+
+void window_destroy(Window *window) {
+  stub_free(window);
+}
+
+void window_set_click_config_provider(Window *window, ClickConfigProvider click_config_provider) {
+  window->click_config_provider = click_config_provider;
+  window->menu = NULL;
+  if (window->loaded) {
+    window_configure_clicks(window);
+  }
+}
+
+void window_set_window_handlers(Window *window, WindowHandlers handlers) {
+  window->handlers = handlers;
+}
+
+Layer *window_get_root_layer(const Window *window) {
+  return (Layer *)&window->root;
+}
+
+void window_set_background_color(Window *window, GColor background_color) {
+  window->background_color = background_color;
+  layer_mark_dirty(&window->root);
+}
+
+bool window_is_loaded(Window *window) {
+  return window->loaded;
+}
+
+void window_stack_push(Window *window, bool animated) {
+  if (s_stack_depth == STUB_MAX_WINDOWS) {
+    return;
+  }
+  if (s_stack_depth > 0 && s_stack[s_stack_depth - 1]->handlers.disappear) {
+    s_stack[s_stack_depth - 1]->handlers.disappear(s_stack[s_stack_depth - 1]);
+  }
+  s_stack[s_stack_depth++] = window;
+  if (!window->loaded) {
+    window->loaded = true;
+    if (window->handlers.load) {
+      window->handlers.load(window);
+    }
+  }
+  if (!window->menu) {
+    window_configure_clicks(window);
+  }
+  if (window->handlers.appear) {
+    window->handlers.appear(window);
+  }
+  window->root.dirty = true;
+}
+
+Window *window_stack_pop(bool animated) {
+  if (s_stack_depth == 0) {
+    return NULL;
+  }
+  Window *window = s_stack[--s_stack_depth];
+  if (window->handlers.disappear) {
+    window->handlers.disappear(window);
+  }
+  window->loaded = false;
+  if (window->handlers.unload) {
+    window->handlers.unload(window);
+  }
+  if (s_stack_depth > 0) {
+    Window *top = s_stack[s_stack_depth - 1];
+    if (top->handlers.appear) {
+      top->handlers.appear(top);
+    }
+    top->root.dirty = true;
+  }
+  return window;
+}
+
+Window *window_stack_get_top_window(void) {
+  return s_stack_depth > 0 ? s_stack[s_stack_depth - 1] : NULL;
+}
+
+MenuLayer *menu_layer_create(GRect frame) {
+  MenuLayer *menu_layer = stub_calloc(1, sizeof(MenuLayer));
+  if (menu_layer) {
+    layer_init(&menu_layer->layer, frame);
+  }
+  return menu_layer;
+}
+
+void menu_layer_destroy(MenuLayer *menu_layer) {
+  layer_destroy((Layer *)menu_layer);
+}
+
+Layer *menu_layer_get_layer(const MenuLayer *menu_layer) {
+  return (Layer *)&menu_layer->layer;
+}
+
+void menu_layer_set_callbacks(MenuLayer *menu_layer, void *callback_context, MenuLayerCallbacks callbacks) {
+  menu_layer->callbacks = callbacks;
+  menu_layer->context = callback_context;
+}
+
+void menu_layer_set_click_config_onto_window(MenuLayer *menu_layer, struct Window *window) {
+  window->menu = menu_layer;
+}
+
+void menu_layer_reload_data(MenuLayer *menu_layer) {
+  layer_mark_dirty(&menu_layer->layer);
+}
+
+void menu_cell_basic_draw(GContext *ctx, const Layer *cell_layer, const char *title, const char *subtitle, GBitmap *icon) {}
+
+static uint16_t menu_num_rows(MenuLayer *menu_layer) {
+  if (!menu_layer->callbacks.get_num_rows) {
+    return 0;
+  }
+  return menu_layer->callbacks.get_num_rows(menu_layer, 0, menu_layer->context);
+}
+
+static void menu_press(MenuLayer *menu_layer, ButtonId button_id) {
+  uint16_t rows = menu_num_rows(menu_layer);
+  MenuIndex old_index = menu_layer->selection;
+  switch (button_id) {
+    case BUTTON_ID_UP:
+      if (menu_layer->selection.row > 0) {
+        menu_layer->selection.row--;
+      }
+      break;
+    case BUTTON_ID_DOWN:
+      if (menu_layer->selection.row + 1 < rows) {
+        menu_layer->selection.row++;
+      }
+      break;
+    case BUTTON_ID_SELECT:
+      if (menu_layer->callbacks.select_click) {
+        menu_layer->callbacks.select_click(menu_layer, &menu_layer->selection, menu_layer->context);
+      }
+      return;
+    default:
+      return;
+  }
+  if (menu_layer->selection.row != old_index.row && menu_layer->callbacks.selection_changed) {
+    menu_layer->callbacks.selection_changed(menu_layer, menu_layer->selection, old_index,
+                                            menu_layer->context);
+  }
+  layer_mark_dirty(&menu_layer->layer);
+}
+
+void stub_press(ButtonId button_id) {
+  Window *window = window_stack_get_top_window();
+  if (!window) {
+    return;
+  }
+  stub_stats.wakeups++;
+  if (button_id == BUTTON_ID_BACK) {
+    if (window->clicks[BUTTON_ID_BACK] && !window->menu) {
+      window->clicks[BUTTON_ID_BACK](NULL, NULL);
+    } else {
+      window_stack_pop(true);
+    }
+    return;
+  }
+  if (window->menu) {
+    menu_press(window->menu, button_id);
+  } else if (window->clicks[button_id]) {
+    window->clicks[button_id](NULL, NULL);
+  }
+}
+
+static void render_layer(Layer *layer) {
+  if (layer->hidden) {
+    return;
+  }
+  if (layer->update_proc) {
+    layer->update_proc(layer, &s_gcontext);
+  }
+  layer->dirty = false;
+  for (Layer *child = layer->first_child; child; child = child->next_sibling) {
+    render_layer(child);
+  }
+}
+
+static bool tree_dirty(Layer *layer) {
+  if (layer->dirty) {
+    return true;
+  }
+  for (Layer *child = layer->first_child; child; child = child->next_sibling) {
+    if (tree_dirty(child)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void stub_render(void) {
+  Window *window = window_stack_get_top_window();
+  if (!window || !tree_dirty(&window->root)) {
+    return;
+  }
+  stub_stats.redraws++;
+  render_layer(&window->root);
+  if (window->menu && window->menu->callbacks.draw_row) {
+    Layer cell;
+    layer_init(&cell, GRect(0, 0, 144, 44));
+    uint16_t rows = menu_num_rows(window->menu);
+    for (uint16_t row = 0; row < rows; row++) {
+      MenuIndex index = { 0, row };
+      window->menu->callbacks.draw_row(&s_gcontext, &cell, &index, window->menu->context);
+    }
+  }
+}
+
+Window *stub_top_window(void) {
+  return window_stack_get_top_window();
+}
+
+int stub_window_stack_depth(void) {
+  return s_stack_depth;
+}
+
+// ---------------------------------------------------------------------------
+// Dictionary, same wire layout as the firmware : a count byte followed by
+// packed tuples
+// ---------------------------------------------------------------------------
+
+struct Dictionary {
+  uint8_t count;
+  uint8_t head[];
+};
+
+static Tuple *tuple_next(Tuple *tuple) {
+  return (Tuple *)((uint8_t *)tuple + TUPLE_HEADER_SIZE + tuple->length);
+}
+
+static bool tuple_fits(const DictionaryIterator *iter, const Tuple *tuple) {
+  const uint8_t *start = (const uint8_t *)tuple;
+  const uint8_t *end = iter->end;
+  return start + TUPLE_HEADER_SIZE <= end &&
+         start + TUPLE_HEADER_SIZE + tuple->length <= end;
+}
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t *const buffer, const uint16_t size) {
+  if (!iter || !buffer || size < 1) {
+    return DICT_INVALID_ARGS;
+  }
+  iter->dictionary = (Dictionary *)buffer;
+  iter->dictionary->count = 0;
+  iter->cursor = (Tuple *)iter->dictionary->head;
+  iter->end = buffer + size;
+  return DICT_OK;
+}
+
+static DictionaryResult dict_write_tuple(DictionaryIterator *iter, uint32_t key, TupleType type,
+                                         const void *data, uint16_t length) {
+  if (!iter || !iter->dictionary) {
+    return DICT_INVALID_ARGS;
+  }
+  uint8_t *start = (uint8_t *)iter->cursor;
+  if (start + TUPLE_HEADER_SIZE + length > (const uint8_t *)iter->end) {
+    return DICT_NOT_ENOUGH_STORAGE;
+  }
+  Tuple *tuple = iter->cursor;
+  tuple->key = key;
+  tuple->type = type;
+  tuple->length = length;
+  if (length) {
+    memcpy(tuple->value->data, data, length);
+  }
+  iter->dictionary->count++;
+  iter->cursor = tuple_next(tuple);
+  return DICT_OK;
+}
+
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t *const data, const uint16_t size) {
+  return dict_write_tuple(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char *const cstring) {
+  uint16_t length = cstring ? (uint16_t)(strlen(cstring) + 1) : 0;
+  return dict_write_tuple(iter, key, TUPLE_CSTRING, cstring, length);
+}
+
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed) {
+  if (width_bytes != 1 && width_bytes != 2 && width_bytes != 4) {
+    return DICT_INVALID_ARGS;
+  }
+  return dict_write_tuple(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes);
+}
+
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_int8(DictionaryIterator *iter, const uint32_t key, const int8_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+DictionaryResult dict_write_int16(DictionaryIterator *iter, const uint32_t key, const int16_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+uint32_t dict_write_end(DictionaryIterator *iter) {
+  if (!iter || !iter->dictionary) {
+    return 0;
+  }
+  iter->end = iter->cursor;
+  return (uint32_t)((uint8_t *)iter->cursor - (uint8_t *)iter->dictionary);
+}
+
+Tuple *dict_read_first(DictionaryIterator *iter) {
+  iter->cursor = (Tuple *)iter->dictionary->head;
+  if (iter->dictionary->count == 0 || !tuple_fits(iter, iter->cursor)) {
+    return NULL;
+  }
+  return iter->cursor;
+}
+
+Tuple *dict_read_next(DictionaryIterator *iter) {
+  if (!iter->cursor || (const void *)iter->cursor >= iter->end) {
+    return NULL;
+  }
+  Tuple *next = tuple_next(iter->cursor);
+  iter->cursor = next;
+  if ((const void *)next >= iter->end || !tuple_fits(iter, next)) {
+    return NULL;
+  }
+  return next;
+}
+
+Tuple *dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t *const buffer, const uint16_t size) {
+  if (!iter || !buffer || size < 1) {
+    return NULL;
+  }
+  iter->dictionary = (Dictionary *)buffer;
+  iter->end = buffer + size;
+  return dict_read_first(iter);
+}
+
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key) {
+  DictionaryIterator scan = *iter;
+  uint8_t remaining = scan.dictionary->count;
+  for (Tuple *tuple = dict_read_first(&scan); tuple && remaining; tuple = dict_read_next(&scan), remaining--) {
+    if (tuple->key == key) {
+      return tuple;
+    }
+  }
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// AppMessage
+// ---------------------------------------------------------------------------
+
+static AppMessageInboxReceived s_inbox_received;
+static AppMessageInboxDropped s_inbox_dropped;
+static AppMessageOutboxSent s_outbox_sent;
+static AppMessageOutboxFailed s_outbox_failed;
+
+static uint8_t *s_inbox_buffer;
+static uint8_t *s_outbox_buffer;
+static uint32_t s_inbox_size;
+static uint32_t s_outbox_size;
+static DictionaryIterator s_outbox_iter;
+static uint16_t s_outbox_length;
+static bool s_outbox_writing;
+static bool s_outbox_pending;
+
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound) {
+  if (s_inbox_buffer) {
+    return APP_MSG_INVALID_ARGS;
+  }
+  s_inbox_size = size_inbound > STUB_INBOX_MAX ? STUB_INBOX_MAX : size_inbound;
+  s_outbox_size = size_outbound > STUB_OUTBOX_MAX ? STUB_OUTBOX_MAX : size_outbound;
+  // The firmware carves both buffers out of the app heap
+  s_inbox_buffer = stub_malloc(s_inbox_size);
+  s_outbox_buffer = stub_malloc(s_outbox_size);
+  if (!s_inbox_buffer || !s_outbox_buffer) {
+    return APP_MSG_OUT_OF_MEMORY;
+  }
+  return APP_MSG_OK;
+}
+
+uint32_t app_message_inbox_size_maximum(void) {
+  return STUB_INBOX_MAX;
+}
+
+uint32_t app_message_outbox_size_maximum(void) {
+  return STUB_OUTBOX_MAX;
+}
+
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator) {
+  if (!s_outbox_buffer) {
+    return APP_MSG_INVALID_ARGS;
+  }
+  if (s_outbox_writing || s_outbox_pending) {
+    stub_stats.outbox_busy++;
+    return APP_MSG_BUSY;
+  }
+  dict_write_begin(&s_outbox_iter, s_outbox_buffer, s_outbox_size);
+  s_outbox_writing = true;
+  *iterator = &s_outbox_iter;
+  return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_send(void) {
+  if (!s_outbox_writing) {
+    return APP_MSG_INVALID_ARGS;
+  }
+  s_outbox_length = (uint16_t)dict_write_end(&s_outbox_iter);
+  s_outbox_writing = false;
+  s_outbox_pending = true;
+  stub_stats.outbox_sends++;
+  return APP_MSG_OK;
+}
+
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback) {
+  AppMessageInboxReceived previous = s_inbox_received;
+  s_inbox_received = received_callback;
+  return previous;
+}
+
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback) {
+  AppMessageInboxDropped previous = s_inbox_dropped;
+  s_inbox_dropped = dropped_callback;
+  return previous;
+}
+
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback) {
+  AppMessageOutboxSent previous = s_outbox_sent;
+  s_outbox_sent = sent_callback;
+  return previous;
+}
+
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback) {
+  AppMessageOutboxFailed previous = s_outbox_failed;
+  s_outbox_failed = failed_callback;
+  return previous;
+}
+
+void stub_inbox_deliver(const uint8_t *buffer, uint16_t size) {
+  stub_stats.wakeups++;
+  if (!s_inbox_buffer || size > s_inbox_size) {
+    if (s_inbox_dropped) {
+      s_inbox_dropped(APP_MSG_BUFFER_OVERFLOW, NULL);
+    }
+    return;
+  }
+  memcpy(s_inbox_buffer, buffer, size);
+  DictionaryIterator iter;
+  dict_read_begin_from_buffer(&iter, s_inbox_buffer, size);
+  if (s_inbox_received) {
+    s_inbox_received(&iter, NULL);
+  }
+}
+
+void stub_inbox_drop(AppMessageResult reason) {
+  stub_stats.wakeups++;
+  if (s_inbox_dropped) {
+    s_inbox_dropped(reason, NULL);
+  }
+}
+
+bool stub_outbox_pending(void) {
+  return s_outbox_pending;
+}
+
+const uint8_t *stub_outbox_data(uint16_t *size) {
+  if (size) {
+    *size = s_outbox_length;
+  }
+  return s_outbox_buffer;
+}
+
+void stub_outbox_complete(AppMessageResult result) {
+  if (!s_outbox_pending) {
+    return;
+  }
+  s_outbox_pending = false;
+  stub_stats.wakeups++;
+  DictionaryIterator iter;
+  dict_read_begin_from_buffer(&iter, s_outbox_buffer, s_outbox_length);
+  if (result == APP_MSG_OK) {
+    if (s_outbox_sent) {
+      s_outbox_sent(&iter, NULL);
+    }
+  } else if (s_outbox_failed) {
+    s_outbox_failed(&iter, result, NULL);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Persistent storage
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  bool used;
+  uint32_t key;
+  uint16_t size;
+  uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} PersistEntry;
+
+static PersistEntry s_persist[STUB_PERSIST_KEYS];
+
+static PersistEntry *persist_lookup(uint32_t key) {
+  for (int i = 0; i < STUB_PERSIST_KEYS; i++) {
+    if (s_persist[i].used && s_persist[i].key == key) {
+      return &s_persist[i];
+    }
+  }
+  return NULL;
+}
+
+static size_t persist_bytes_used(void) {
+  size_t total = 0;
+  for (int i = 0; i < STUB_PERSIST_KEYS; i++) {
+    if (s_persist[i].used) {
+      total += s_persist[i].size;
+    }
+  }
+  return total;
+}
+
+static int persist_store(uint32_t key, const void *data, size_t size) {
+  stub_stats.persist_writes++;
+  if (size > PERSIST_DATA_MAX_LENGTH) {
+    size = PERSIST_DATA_MAX_LENGTH;
+  }
+  PersistEntry *entry = persist_lookup(key);
+  size_t used = persist_bytes_used() - (entry ? entry->size : 0);
+  if (used + size > STUB_PERSIST_BUDGET) {
+    return E_OUT_OF_STORAGE;
+  }
+  if (!entry) {
+    for (int i = 0; i < STUB_PERSIST_KEYS && !entry; i++) {
+      if (!s_persist[i].used) {
+        entry = &s_persist[i];
+      }
+    }
+    if (!entry) {
+      return E_OUT_OF_RESOURCES;
+    }
+  }
+  entry->used = true;
+  entry->key = key;
+  entry->size = (uint16_t)size;
+  memcpy(entry->data, data, size);
+  return (int)size;
+}
+
+bool persist_exists(const uint32_t key) {
+  stub_stats.persist_reads++;
+  return persist_lookup(key) != NULL;
+}
+
+int persist_get_size(const uint32_t key) {
+  stub_stats.persist_reads++;
+  PersistEntry *entry = persist_lookup(key);
+  return entry ? entry->size : E_DOES_NOT_EXIST;
+}
+
+int32_t persist_read_int(const uint32_t key) {
+  stub_stats.persist_reads++;
+  PersistEntry *entry = persist_lookup(key);
+  int32_t value = 0;
+  if (entry && entry->size >= sizeof(value)) {
+    memcpy(&value, entry->data, sizeof(value));
+  }
+  return value;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size) {
+  stub_stats.persist_reads++;
+  PersistEntry *entry = persist_lookup(key);
+  if (!entry) {
+    return E_DOES_NOT_EXIST;
+  }
+  size_t size = entry->size < buffer_size ? entry->size : buffer_size;
+  memcpy(buffer, entry->data, size);
+  return (int)size;
+}
+
+status_t persist_write_int(const uint32_t key, const int32_t value) {
+  int result = persist_store(key, &value, sizeof(value));
+  return result < 0 ? result : S_SUCCESS;
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size) {
+  return persist_store(key, data, size);
+}
+
+status_t persist_delete(const uint32_t key) {
+  stub_stats.persist_writes++;
+  PersistEntry *entry = persist_lookup(key);
+  if (!entry) {
+    return E_DOES_NOT_EXIST;
+  }
+  entry->used = false;
+  return S_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// Services
+// ---------------------------------------------------------------------------
+
+static TickHandler s_tick_handler;
+static TimeUnits s_tick_units;
+static AccelDataHandler s_accel_handler;
+static AccelDataHandler s_worker_accel_handler;
+static uint32_t s_accel_samples = STUB_ACCEL_MAX_BATCH;
+static AccelSamplingRate s_accel_rate = ACCEL_SAMPLING_25HZ;
+static BatteryStateHandler s_battery_handler;
+static BatteryChargeState s_battery = { .charge_percent = 80, .is_charging = false, .is_plugged = false };
+
+void tick_timer_service_subscribe(TimeUnits tick_units, TickHandler handler) {
+  s_tick_units = tick_units;
+  s_tick_handler = handler;
+}
+
+void tick_timer_service_unsubscribe(void) {
+  s_tick_units = 0;
+  s_tick_handler = NULL;
+}
+
+void stub_tick(TimeUnits units_changed) {
+  if (!s_tick_handler || !(units_changed & s_tick_units)) {
+    return;
+  }
+  stub_stats.wakeups++;
+  time_t now = stub_time(NULL);
+  struct tm *tick_time = gmtime(&now);
+  s_tick_handler(tick_time, units_changed);
+}
+
+TimeUnits stub_tick_units(void) {
+  return s_tick_handler ? s_tick_units : 0;
+}
+
+void accel_data_service_subscribe(uint32_t samples_per_update, AccelDataHandler handler) {
+  s_accel_handler = handler;
+  accel_service_set_samples_per_update(samples_per_update);
+}
+
+void accel_data_service_unsubscribe(void) {
+  s_accel_handler = NULL;
+}
+
+int accel_service_set_sampling_rate(AccelSamplingRate rate) {
+  s_accel_rate = rate;
+  return 0;
+}
+
+int accel_service_set_samples_per_update(uint32_t num_samples) {
+  if (num_samples > STUB_ACCEL_MAX_BATCH) {
+    num_samples = STUB_ACCEL_MAX_BATCH;
+  }
+  s_accel_samples = num_samples;
+  return 0;
+}
+
+void stub_worker_accel_subscribe(uint32_t samples_per_update, AccelDataHandler handler) {
+  s_worker_accel_handler = handler;
+  accel_service_set_samples_per_update(samples_per_update);
+}
+
+void stub_worker_accel_unsubscribe(void) {
+  s_worker_accel_handler = NULL;
+}
+
+// Both the app and the worker get the batch when they subscribed
+void stub_accel_deliver(AccelData *data, uint32_t num_samples) {
+  if (s_worker_accel_handler) {
+    stub_stats.worker_wakeups++;
+    s_worker_accel_handler(data, num_samples);
+  }
+  if (s_accel_handler) {
+    stub_stats.wakeups++;
+    s_accel_handler(data, num_samples);
+  }
+}
+
+uint32_t stub_accel_samples_per_update(void) {
+  return s_accel_samples;
+}
+
+AccelSamplingRate stub_accel_sampling_rate(void) {
+  return s_accel_rate;
+}
+
+bool stub_accel_subscribed(void) {
+  return s_accel_handler != NULL || s_worker_accel_handler != NULL;
+}
+
+BatteryChargeState battery_state_service_peek(void) {
+  return s_battery;
+}
+
+void battery_state_service_subscribe(BatteryStateHandler handler) {
+  s_battery_handler = handler;
+}
+
+void battery_state_service_unsubscribe(void) {
+  s_battery_handler = NULL;
+}
+
+void stub_battery_set(BatteryChargeState state) {
+  s_battery = state;
+  if (s_battery_handler) {
+    stub_stats.wakeups++;
+    s_battery_handler(state);
+  }
+}
+
+bool stub_battery_subscribed(void) {
+  return s_battery_handler != NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Background worker
+// ---------------------------------------------------------------------------
+
+static void (*s_worker_init)(void);
+static void (*s_worker_deinit)(void);
+static bool s_worker_running;
+static bool s_worker_starting;                         // Launched, runs on the next event
+static AppWorkerMessageHandler s_app_worker_handler;   // Messages to the app
+static AppWorkerMessageHandler s_worker_handler;       // Messages to the worker
+
+void stub_worker_set(void (*init)(void), void (*deinit)(void)) {
+  s_worker_init = init;
+  s_worker_deinit = deinit;
+}
+
+bool app_worker_is_running(void) {
+  return s_worker_running;
+}
+
+AppWorkerResult app_worker_launch(void) {
+  if (!s_worker_init) {
+    return APP_WORKER_RESULT_NO_WORKER;
+  }
+  if (s_worker_running || s_worker_starting) {
+    return APP_WORKER_RESULT_ALREADY_RUNNING;
+  }
+  s_worker_starting = true;
+  return APP_WORKER_RESULT_SUCCESS;
+}
+
+// The launch only asks the system for the worker, which starts once the app
+// is back in its event loop. Until then it is not running and the messages
+// sent to it are lost.
+static void stub_worker_start(void) {
+  if (s_worker_starting) {
+    s_worker_starting = false;
+    s_worker_running = true;
+    s_worker_init();
+  }
+}
+
+AppWorkerResult app_worker_kill(void) {
+  if (!s_worker_running) {
+    s_worker_starting = false;
+    return APP_WORKER_RESULT_NOT_RUNNING;
+  }
+  s_worker_deinit();
+  s_worker_running = false;
+  return APP_WORKER_RESULT_SUCCESS;
+}
+
+bool app_worker_message_subscribe(AppWorkerMessageHandler handler) {
+  s_app_worker_handler = handler;
+  return true;
+}
+
+bool app_worker_message_unsubscribe(void) {
+  s_app_worker_handler = NULL;
+  return true;
+}
+
+// Messages are handled right away rather than on the next event of the
+// other side, and lost when nobody listens, as on the watch
+void app_worker_send_message(uint8_t type, AppWorkerMessage *data) {
+  if (s_worker_running && s_worker_handler) {
+    stub_stats.worker_wakeups++;
+    s_worker_handler(type, data);
+  }
+}
+
+bool stub_worker_message_subscribe(AppWorkerMessageHandler handler) {
+  s_worker_handler = handler;
+  return true;
+}
+
+bool stub_worker_message_unsubscribe(void) {
+  s_worker_handler = NULL;
+  return true;
+}
+
+void stub_worker_send_message(uint8_t type, AppWorkerMessage *data) {
+  if (s_app_worker_handler) {
+    stub_stats.wakeups++;
+    s_app_worker_handler(type, data);
+  }
+}
+
+void worker_event_loop(void) {}
+
+// ---------------------------------------------------------------------------
+// Event loop and driver helpers
+// ---------------------------------------------------------------------------
+
+void app_event_loop(void) {}
+
+void stub_reset_stats(void) {
+  memset(&stub_stats, 0, sizeof(stub_stats));
+}
+
+void stub_reset(void) {
+  stub_reset_stats();
+  memset(s_persist, 0, sizeof(s_persist));
+  memset(s_timers, 0, sizeof(s_timers));
+  s_now_ms = STUB_EPOCH_MS;
+  s_stack_depth = 0;
+  s_tick_handler = NULL;
+  s_accel_handler = NULL;
+  s_worker_accel_handler = NULL;
+  s_battery_handler = NULL;
+  s_worker_init = NULL;
+  s_worker_deinit = NULL;
+  s_worker_running = false;
+  s_worker_starting = false;
+  s_app_worker_handler = NULL;
+  s_worker_handler = NULL;
+  s_outbox_writing = false;
+  s_outbox_pending = false;
+  stub_free(s_inbox_buffer);
+  stub_free(s_outbox_buffer);
+  s_inbox_buffer = NULL;
+  s_outbox_buffer = NULL;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+// Stand-in for the SDK pebble_worker.h. The worker runs in the process of
+// the app, so the calls both sides make reach the stub as worker calls.
+
+#include "pebble.h"
+
+#define app_worker_message_subscribe    stub_worker_message_subscribe
+#define app_worker_message_unsubscribe  stub_worker_message_unsubscribe
+#define app_worker_send_message         stub_worker_send_message
+#define accel_data_service_subscribe    stub_worker_accel_subscribe
+#define accel_data_service_unsubscribe  stub_worker_accel_unsubscribe
@@ -0,0 +1,229 @@
+// Replay of session traces recorded with TRACE_RECORD (src/trace.h).
+//
+// Records are fed back at their recorded time on the stub clock, so timers
+// fire as they did on the watch, and the phone acknowledges the messages of
+// the app when and how it did in the session. The worker does not run, its
+// messages to the app come from the trace.
+
+#define _POSIX_C_SOURCE 199309L
+#define PEBBLE_STUB_INTERNAL
+
+#include <pebble.h>
+#include <ctype.h>
+#include "trace.h"
+#include "replay.h"
+
+typedef struct {
+  const char *name;
+  unsigned long calls;
+  uint64_t ns;
+  uint64_t max_ns;
+} ReplayStat;
+
+static ReplayStat s_stats[] = {
+  [TRACE_INBOX] = { "received_handler" },
+  [TRACE_CLICK] = { "click handlers" },
+  [TRACE_WORKER] = { "worker messages" },
+};
+
+static uint64_t replay_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void replay_account(TraceType type, uint64_t start) {
+  uint64_t elapsed = replay_clock_ns() - start;
+  s_stats[type].calls++;
+  s_stats[type].ns += elapsed;
+  if (elapsed > s_stats[type].max_ns) {
+    s_stats[type].max_ns = elapsed;
+  }
+}
+
+static int hex_value(int c) {
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+// Keeps the bytes of the "TRACE " lines of a log, in place
+static size_t replay_from_log(uint8_t *data, size_t size) {
+  size_t length = 0;
+  const char *text = (const char *)data;
+  const char *end = text + size;
+  for (const char *line = text; line < end; ) {
+    const char *next = memchr(line, '\n', end - line);
+    next = next ? next + 1 : end;
+    const char *mark = line;
+    while (mark + 6 <= next && memcmp(mark, "TRACE ", 6) != 0) {
+      mark++;
+    }
+    for (mark += 6; mark + 1 < next && isxdigit((unsigned char)mark[0]) && isxdigit((unsigned char)mark[1]); mark += 2) {
+      data[length++] = hex_value(mark[0]) << 4 | hex_value(mark[1]);
+    }
+    line = next;
+  }
+  return length;
+}
+
+static uint8_t *replay_load(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  size_t capacity = 4096;
+  uint8_t *data = malloc(capacity);
+  *size = 0;
+  size_t count;
+  while (data && (count = fread(data + *size, 1, capacity - *size, file)) > 0) {
+    *size += count;
+    if (*size == capacity) {
+      capacity *= 2;
+      uint8_t *grown = realloc(data, capacity);
+      if (!grown) {
+        free(data);
+      }
+      data = grown;
+    }
+  }
+  fclose(file);
+  if (data && (*size < TRACE_MAGIC_SIZE || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0)) {
+    *size = replay_from_log(data, *size);
+  }
+  if (data && (*size < TRACE_MAGIC_SIZE || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0)) {
+    free(data);
+    data = NULL;
+  }
+  return data;
+}
+
+static uint32_t read_le(const uint8_t *data, int bytes) {
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = value << 8 | data[i];
+  }
+  return value;
+}
+
+// Moves the clock on, with the second ticks the watch would have had
+static void replay_advance(uint32_t ms) {
+  while (ms > 0) {
+    uint32_t to_second = 1000 - stub_now_ms() % 1000;
+    uint32_t step = ms < to_second ? ms : to_second;
+    stub_advance_ms(step);
+    ms -= step;
+    if (step == to_second) {
+      stub_tick(SECOND_UNIT);
+    }
+  }
+}
+
+static void print_text(const char *text) {
+  putchar('"');
+  for (; text && *text; text++) {
+    if (*text == '\n') {
+      fputs(" | ", stdout);
+    } else {
+      putchar(*text);
+    }
+  }
+  puts("\"");
+}
+
+int replay_run(const char *path, const ReplayHooks *hooks) {
+  size_t size;
+  uint8_t *data = replay_load(path, &size);
+  if (!data) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return 1;
+  }
+
+  bool started = false;
+  uint32_t now_ms = 0;
+  unsigned long records = 0, recorded_sends = 0, identical_sends = 0, skipped = 0;
+  uint32_t sends_before = 0;
+
+  for (size_t offset = TRACE_MAGIC_SIZE; offset + TRACE_HEADER_SIZE <= size; ) {
+    const uint8_t *header = data + offset;
+    uint32_t time_ms = read_le(header, 4);
+    TraceType type = header[4];
+    uint16_t length = read_le(header + 5, 2);
+    const uint8_t *payload = header + TRACE_HEADER_SIZE;
+    offset += TRACE_HEADER_SIZE + length;
+    if (offset > size) {
+      break;
+    }
+    records++;
+
+    if (type == TRACE_PERSIST) {
+      if (length >= 4) {
+        persist_write_data(read_le(payload, 4), payload + 4, length - 4);
+      }
+      continue;
+    }
+    if (!started) {
+      started = true;
+      sends_before = stub_stats.outbox_sends;
+      hooks->start();
+    }
+    if (time_ms > now_ms) {
+      replay_advance(time_ms - now_ms);
+      now_ms = time_ms;
+    }
+
+    uint64_t start;
+    switch (type) {
+      case TRACE_INBOX:
+        start = replay_clock_ns();
+        stub_inbox_deliver(payload, length);
+        replay_account(type, start);
+        break;
+      case TRACE_OUTBOX:
+        recorded_sends++;
+        if (stub_outbox_pending()) {
+          uint16_t sent_size;
+          const uint8_t *sent = stub_outbox_data(&sent_size);
+          identical_sends += sent_size == length && memcmp(sent, payload, length) == 0;
+        }
+        break;
+      case TRACE_OUTBOX_DONE:
+        if (stub_outbox_pending() && length >= 4) {
+          stub_outbox_complete((AppMessageResult)read_le(payload, 4));
+        }
+        break;
+      case TRACE_WORKER:
+        if (length >= 8) {
+          AppWorkerMessage message = { read_le(payload + 2, 2), read_le(payload + 4, 2), read_le(payload + 6, 2) };
+          start = replay_clock_ns();
+          stub_worker_send_message(read_le(payload, 2), &message);
+          replay_account(type, start);
+        }
+        break;
+      case TRACE_CLICK:
+        start = replay_clock_ns();
+        stub_press(length ? payload[0] : BUTTON_ID_SELECT);
+        replay_account(type, start);
+        break;
+      default:
+        skipped++;
+    }
+  }
+  if (!started) {
+    hooks->start();
+  }
+
+  printf("replay %s: %lu records over %.1f s, %lu skipped\n", path, records, now_ms / 1000.0, skipped);
+  printf("%-20s %8s %10s %10s\n", "handler", "calls", "ns/call", "max ns");
+  for (size_t i = 0; i < sizeof(s_stats) / sizeof(s_stats[0]); i++) {
+    if (s_stats[i].name) {
+      printf("%-20s %8lu %10.1f %10llu\n", s_stats[i].name, s_stats[i].calls,
+             s_stats[i].calls ? (double)s_stats[i].ns / s_stats[i].calls : 0.0,
+             (unsigned long long)s_stats[i].max_ns);
+    }
+  }
+  printf("sends: %lu recorded, %u replayed, %lu identical\n",
+         recorded_sends, stub_stats.outbox_sends - sends_before, identical_sends);
+  printf("screen: ");
+  print_text(hooks->shown_text());
+  free(data);
+  return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+// What the replay needs from the app under test
+typedef struct {
+  void (*start)(void);            // Launches the app, once the settings are restored
+  const char *(*shown_text)(void); // Text of the main output
+} ReplayHooks;
+
+// Feeds a session trace (src/trace.h), binary or as `pebble logs` output,
+// into the handlers and prints the time spent per handler. Returns 0, or 1
+// when the trace cannot be read.
+int replay_run(const char *path, const ReplayHooks *hooks);
@@ -0,0 +1,525 @@
+// Host checks of what the src/main.c handlers do, against the phone of
+// harness.h : the text on screen, the messages sent and the persist and heap
+// traffic. Each test runs in a process of its own from a fresh launch, so
+// the statics of the app start over and a crash fails that test only.
+//
+//   ihm-test [test-name-prefix]     exits 1 when a check fails
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <pebble.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "harness.h"
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} Test;
+
+static int s_failures = 0;
+
+#define CHECK(condition)        check((condition), #condition, __LINE__)
+#define CHECK_TEXT(expected)    check_text((expected), __LINE__)
+
+static void check(bool ok, const char *condition, int line) {
+  if (!ok) {
+    printf("  test.c:%d: %s\n", line, condition);
+    s_failures++;
+  }
+}
+
+static void check_text(const char *expected, int line) {
+  if (strcmp(shown_text(), expected) != 0) {
+    printf("  test.c:%d: shown \"%s\", expected \"%s\"\n", line, shown_text(), expected);
+    s_failures++;
+  }
+}
+
+// Request id of the message waiting in the outbox, -1 when there is none
+static int outbox_request(void) {
+  uint16_t size;
+  const uint8_t *data = stub_outbox_pending() ? stub_outbox_data(&size) : NULL;
+  DictionaryIterator iter;
+  Tuple *tuple = data ? dict_read_begin_from_buffer(&iter, data, size) : NULL;
+  return tuple ? (int)tuple->key : -1;
+}
+
+static void deliver(void) {
+  stub_inbox_deliver(s_message, s_message_size);
+}
+
+// Screens saved by a version that used one key per screen, -1 for none
+static void launch_with(int screen1, int screen2, int screen3, int screen4) {
+  const int screens[NUMBER_OF_SCREENS] = { screen1, screen2, screen3, screen4 };
+  for (int i = 0; i < NUMBER_OF_SCREENS; i++) {
+    if (screens[i] != -1) {
+      persist_write_int(PERSIST_SCREEN1 + i, screens[i]);
+    }
+  }
+  init();
+}
+
+static void launch_typical(void) {
+  launch_with(REQUEST_LOCATION, REQUEST_WEATHER_TEMPERATURE, SHOW_UP_TIME, REQUEST_TRANSPORT);
+}
+
+static void test_launch(void) {
+  launch_typical();
+  CHECK(outbox_request() == REQUEST_LOCATION);
+  CHECK(stub_window_stack_depth() == 1);
+}
+
+static void test_answer_shown(void) {
+  launch_typical();
+  ack_outbox();
+  setup_location();
+  deliver();
+  CHECK_TEXT("lat : 46.519100\nlon : 6.632300");
+  setup_location_text();
+  deliver();
+  CHECK_TEXT("lat : 46.519100\nlon : 6.632300");
+}
+
+// A fresh install has no item chosen, the first screen shows the location
+static void test_answer_shown_unassigned(void) {
+  launch_with(-1, -1, -1, -1);
+  CHECK(outbox_request() == REQUEST_LOCATION);
+  CHECK_TEXT("Loading...");
+  ack_outbox();
+  setup_location();
+  deliver();
+  CHECK_TEXT("lat : 46.519100\nlon : 6.632300");
+  stub_press(BUTTON_ID_UP);
+  ack_outbox();
+  stub_reset_stats();
+  stub_press(BUTTON_ID_DOWN);
+  CHECK_TEXT("lat : 46.519100\nlon : 6.632300");
+  CHECK(stub_stats.outbox_sends == 0);
+}
+
+// Answers longer than the display are cut, not written past the text
+static void test_long_answer_cut(void) {
+  char station[200];
+  DictionaryIterator iter;
+  launch_typical();
+  ack_outbox();
+  memset(station, 'x', sizeof(station) - 1);
+  station[sizeof(station) - 1] = '\0';
+  message_begin(&iter, REQUEST_LOCATION);
+  dict_write_cstring(&iter, KEY_LATITUDE, station);
+  dict_write_cstring(&iter, KEY_LONGITUDE, station);
+  message_end(&iter);
+  deliver();
+  CHECK(strncmp(shown_text(), "lat : xxx", 9) == 0);
+  CHECK(strlen(shown_text()) == MAX_TEXT_SIZE - 1);
+}
+
+// The same answer again leaves the screen as drawn
+static void test_redraw_on_change(void) {
+  launch_typical();
+  ack_outbox();
+  setup_location();
+  deliver();
+  stub_render();
+  stub_reset_stats();
+  deliver();
+  stub_render();
+  CHECK(stub_stats.redraws == 0);
+  setup_location_text();
+  deliver();
+  stub_render();
+  CHECK(stub_stats.redraws == 0);
+}
+
+// Back on a screen within the ttl of its answer, nothing is asked again
+static void test_answer_cached(void) {
+  launch_typical();
+  phone_answer();
+  stub_press(BUTTON_ID_UP);
+  phone_answer();
+  stub_reset_stats();
+  stub_press(BUTTON_ID_DOWN);
+  CHECK_TEXT("lat : 0.000042\nlon : 0.000042");
+  CHECK(stub_stats.outbox_sends == 0);
+  stub_advance_ms(s_config.ttl[REQUEST_LOCATION] * 1000);
+  stub_press(BUTTON_ID_UP);
+  stub_press(BUTTON_ID_DOWN);
+  CHECK(outbox_request() == REQUEST_LOCATION);
+  CHECK_TEXT("lat : 0.000042\nlon : 0.000042");
+}
+
+// The items of the screens next to the shown one are asked in the
+// background, so switching to them waits for nothing
+static void test_neighbours_prefetched(void) {
+  launch_with(REQUEST_LOCATION, REQUEST_ELEVATION, SHOW_UP_TIME, REQUEST_TRANSPORT);
+  phone_answer();
+  stub_reset_stats();
+  stub_press(BUTTON_ID_UP);
+  CHECK(stub_stats.outbox_sends == 0);
+  CHECK_TEXT("altitude : 42m");
+  stub_press(BUTTON_ID_DOWN);
+  stub_press(BUTTON_ID_DOWN);
+  CHECK(stub_stats.outbox_sends == 0);
+}
+
+static void test_config_migrated(void) {
+  stub_reset_stats();
+  launch_typical();
+  CHECK(persist_exists(PERSIST_CONFIG));
+  for (int i = 0; i < NUMBER_OF_SCREENS; i++) {
+    CHECK(!persist_exists(PERSIST_SCREEN1 + i));
+  }
+  CHECK(s_config.screens[3] == REQUEST_TRANSPORT);
+  stub_reset_stats();
+  config_load();
+  CHECK(stub_stats.persist_reads == 1);
+  CHECK(stub_stats.persist_writes == 0);
+  CHECK(s_config.screens[3] == REQUEST_TRANSPORT);
+}
+
+// Blobs of an older layout are taken only whole, anything else leaves the
+// defaults
+static void test_config_blobs(void) {
+  ConfigV1 v1 = { .version = 1, .screens = { REQUEST_ELEVATION, -1, -1, -1 },
+                  .still_rate = ACCEL_SAMPLING_25HZ, .moving_rate = ACCEL_SAMPLING_50HZ };
+  persist_write_data(PERSIST_CONFIG, &v1, sizeof(v1));
+  config_load();
+  CHECK(s_config.screens[0] == REQUEST_ELEVATION && s_config.screens[1] == -1);
+  CHECK(s_config.moving_rate == ACCEL_SAMPLING_50HZ);
+  CHECK(s_config.version == CONFIG_VERSION && s_config_dirty);
+
+  persist_write_data(PERSIST_CONFIG, &v1, sizeof(v1) - 1);
+  config_load();
+  CHECK(s_config.screens[0] == -1);
+  CHECK(s_config.still_rate == ACCEL_SAMPLING_10HZ && s_config.moving_rate == ACCEL_SAMPLING_25HZ);
+  CHECK(s_config.ttl[REQUEST_LOCATION] == s_requests[REQUEST_LOCATION].ttl);
+
+  Config v2 = s_config;
+  v2.screens[0] = REQUEST_ELEVATION;
+  v2.version = 0;
+  persist_write_data(PERSIST_CONFIG, &v2, sizeof(v2));
+  config_load();
+  CHECK(s_config.screens[0] == -1);
+  v2.version = CONFIG_VERSION;
+  persist_write_data(PERSIST_CONFIG, &v2, sizeof(v2) - 2);
+  config_load();
+  CHECK(s_config.screens[0] == -1);
+  persist_write_data(PERSIST_CONFIG, &v2, sizeof(v2));
+  config_load();
+  CHECK(s_config.screens[0] == REQUEST_ELEVATION);
+}
+
+// Screens added cycle with the others, removing them moves off a screen gone
+static void test_screens_resized(void) {
+  launch_typical();
+  ack_outbox();
+  screens_resize(6);
+  CHECK(s_config.num_screens == 6 && s_config.screens[5] == -1);
+  for (int i = 0; i < 5; i++) {
+    stub_press(BUTTON_ID_UP);
+    ack_outbox();
+  }
+  CHECK(currentScreen == 5);
+  stub_press(BUTTON_ID_UP);
+  ack_outbox();
+  CHECK(currentScreen == 0);
+  stub_press(BUTTON_ID_DOWN);
+  ack_outbox();
+  screens_resize(2);
+  CHECK(currentScreen == 1 && s_config.num_screens == 2);
+  CHECK(s_config.screens[2] == -1 && s_config.screens[3] == -1);
+}
+
+// Choosing an item writes the settings once, choosing it again not at all
+static void test_config_written_on_change(void) {
+  launch_typical();
+  ack_outbox();
+  window_stack_push(config_window, false);
+  stub_reset_stats();
+  stub_press(BUTTON_ID_UP);
+  stub_press(BUTTON_ID_SELECT);
+  CHECK(stub_stats.persist_writes == 1);
+  CHECK(s_config.screens[0] == REQUEST_LOCATION + 1);
+  stub_press(BUTTON_ID_SELECT);
+  CHECK(stub_stats.persist_writes == 1);
+}
+
+// The tick and battery services run only while a screen shows them
+static void test_services_follow_screen(void) {
+  launch_typical();
+  ack_outbox();
+  CHECK(stub_tick_units() == 0 && !stub_battery_subscribed());
+  stub_press(BUTTON_ID_UP);
+  ack_outbox();
+  stub_press(BUTTON_ID_UP);
+  CHECK(stub_tick_units() == SECOND_UNIT);
+  stub_press(BUTTON_ID_DOWN);
+  ack_outbox();
+  CHECK(stub_tick_units() == 0 && !stub_battery_subscribed());
+}
+
+// The worker starts after init, so what init sends it is lost. Its first
+// totals get the rates of the config and the watch of the shown screen, and
+// it keeps the rates for the starts without the app.
+static void test_worker_handshake(void) {
+  config_load();
+  Config config = s_config;
+  config.screens[0] = SHOW_ACTIVE_TIME;
+  config.still_rate = ACCEL_SAMPLING_25HZ;
+  config.moving_rate = ACCEL_SAMPLING_50HZ;
+  persist_write_data(PERSIST_CONFIG, &config, sizeof(config));
+  init();
+  CHECK(!app_worker_is_running());
+  stub_advance_ms(0);
+  CHECK(app_worker_is_running());
+  CHECK(s_still_rate == ACCEL_SAMPLING_25HZ && s_moving_rate == ACCEL_SAMPLING_50HZ);
+  CHECK(s_watched);
+
+  app_worker_kill();
+  s_still_rate = ACCEL_SAMPLING_10HZ;
+  s_moving_rate = ACCEL_SAMPLING_25HZ;
+  app_worker_launch();
+  stub_advance_ms(0);
+  CHECK(s_still_rate == ACCEL_SAMPLING_25HZ && s_moving_rate == ACCEL_SAMPLING_50HZ);
+  CHECK(s_rate == ACCEL_SAMPLING_25HZ);
+}
+
+static void test_outbox_retry(void) {
+  launch_typical();
+  stub_reset_stats();
+  stub_outbox_complete(APP_MSG_SEND_TIMEOUT);
+  CHECK(!stub_outbox_pending());
+  stub_advance_ms(OUTBOX_RETRY_MS);
+  CHECK(outbox_request() == REQUEST_LOCATION);
+  CHECK(stub_stats.outbox_sends == 1);
+  CHECK(s_stats.failed == 1);
+}
+
+// Four weather screens are answered by one bundled request
+static void test_weather_bundle(void) {
+  launch_with(REQUEST_WEATHER_STATUS, REQUEST_WEATHER_TEMPERATURE, REQUEST_WEATHER_WIND,
+              REQUEST_WEATHER_SUNSET);
+  CHECK(outbox_request() == REQUEST_WEATHER_ALL);
+  phone_answer();
+  CHECK_TEXT("Clouds\nbroken clouds");
+  stub_reset_stats();
+  for (int i = 0; i < NUMBER_OF_SCREENS; i++) {
+    stub_press(BUTTON_ID_UP);
+    phone_answer();
+  }
+  CHECK(stub_stats.outbox_sends == 0);
+  CHECK_TEXT("Clouds\nbroken clouds");
+}
+
+static void test_stats_dump(void) {
+  launch_typical();
+  phone_answer();
+  DictionaryIterator iter;
+  dict_write_begin(&iter, s_message, sizeof(s_message));
+  dict_write_uint8(&iter, KEY_STATS, 0);
+  message_end(&iter);
+  deliver();
+  uint16_t size;
+  const uint8_t *data = stub_outbox_data(&size);
+  Tuple *tuple = data ? dict_read_begin_from_buffer(&iter, data, size) : NULL;
+  CHECK(tuple && tuple->key == KEY_STATS && tuple->type == TUPLE_BYTE_ARRAY);
+  // Counted before the dump itself is sent
+  CHECK(tuple && tuple->length >= STATS_HEADER_SIZE && s_stats.sent > 1 &&
+        unpack_uint32(tuple->value->data) == s_stats.sent - 1);
+}
+
+// Answers, presses and ticks run without touching the heap or the flash
+static void test_handlers_stay_in_ram(void) {
+  launch_typical();
+  phone_answer();
+  stub_reset_stats();
+  for (int i = 0; i < 2 * NUMBER_OF_SCREENS; i++) {
+    stub_press(BUTTON_ID_UP);
+    phone_answer();
+    stub_advance_ms(1000);
+    stub_tick(SECOND_UNIT);
+    stub_render();
+  }
+  CHECK(stub_stats.allocs == 0);
+  CHECK(stub_stats.persist_writes == 0);
+}
+
+static void test_menu_keeps_heap(void) {
+  launch_typical();
+  phone_answer();
+  size_t heap = heap_bytes_used();
+  for (int i = 0; i < 3; i++) {
+    stub_press(BUTTON_ID_SELECT);
+    CHECK(stub_top_window() == s_menu_window);
+    stub_press(BUTTON_ID_SELECT);
+    CHECK(stub_top_window() == config_window);
+    stub_press(BUTTON_ID_BACK);
+    stub_press(BUTTON_ID_BACK);
+    phone_answer();
+  }
+  CHECK(stub_top_window() == main_window);
+  CHECK(heap_bytes_used() == heap);
+  CHECK_TEXT("lat : 0.000042\nlon : 0.000042");
+}
+
+// Unknown ids, missing keys and keys of another type neither crash nor
+// show garbage
+static void test_malformed_answers(void) {
+  DictionaryIterator iter;
+  launch_typical();
+  ack_outbox();
+  message_begin(&iter, 99);
+  message_end(&iter);
+  deliver();
+  CHECK_TEXT("Error.\nPlease check your dictionary KEYS");
+  dict_write_begin(&iter, s_message, sizeof(s_message));
+  dict_write_cstring(&iter, PEBBLE_KEY_VALUE, "0");
+  message_end(&iter);
+  deliver();
+  CHECK_TEXT("Error.\nPlease check your dictionary KEYS");
+  message_begin(&iter, REQUEST_LOCATION);
+  dict_write_data(&iter, KEY_LATITUDE, (const uint8_t *)"abc", 3);
+  message_end(&iter);
+  deliver();
+  CHECK_TEXT("lat : \nlon : ");
+  CHECK(!s_position_known);
+}
+
+static void test_navigation_stops(void) {
+  launch_typical();
+  ack_outbox();
+  screen_set_request(1, REQUEST_START_THREADED_LOCATION);
+  stub_press(BUTTON_ID_UP);
+  CHECK(outbox_request() == REQUEST_START_THREADED_LOCATION);
+  ack_outbox();
+  nav_message(true, 0, 0);
+  deliver();
+  stub_render();
+  CHECK(s_running_service == SERVICE_NAV);
+  stub_press(BUTTON_ID_UP);
+  CHECK(s_running_service != SERVICE_NAV);
+  CHECK(s_nav_timer == NULL);
+}
+
+// The phone acknowledging the stop leaves the screen moved to as it is
+static void test_navigation_stop_acknowledged(void) {
+  launch_typical();
+  ack_outbox();
+  screen_set_request(1, REQUEST_START_THREADED_LOCATION);
+  stub_press(BUTTON_ID_UP);
+  phone_answer();
+  CHECK(s_running_service == SERVICE_NAV);
+  stub_press(BUTTON_ID_UP);
+  CHECK(outbox_request() == REQUEST_STOP_THREADED_LOCATION);
+  char shown[MAX_TEXT_SIZE];
+  strcpy(shown, shown_text());
+  phone_answer();
+  CHECK_TEXT(shown);
+}
+
+static void test_transport_countdown(void) {
+  launch_typical();
+  ack_outbox();
+  for (int i = 0; i < 3; i++) {
+    stub_press(BUTTON_ID_UP);
+    ack_outbox();
+  }
+  CHECK(screen_get_request(currentScreen, 0) == REQUEST_TRANSPORT);
+  transport_answer();
+  deliver();
+  char first[MAX_TEXT_SIZE];
+  strcpy(first, shown_text());
+  CHECK(strstr(first, "Yverdon-les-Bains, Gare : ") == first);
+  stub_reset_stats();
+  stub_advance_ms(1000);
+  stub_tick(SECOND_UNIT);
+  CHECK(strcmp(shown_text(), first) != 0);
+  CHECK(stub_stats.outbox_sends == 0);
+}
+
+// Up time and transport both run on the tick service, each shows its own
+// text as soon as the screen moves to it
+static void test_tick_screens_switch(void) {
+  launch_typical();
+  for (int i = 0; i < 3; i++) {
+    phone_answer();
+    stub_press(BUTTON_ID_UP);
+  }
+  phone_answer();
+  CHECK(strstr(shown_text(), "\nin ") != NULL);
+  stub_press(BUTTON_ID_DOWN);
+  CHECK(strstr(shown_text(), "Uptime") == shown_text());
+  stub_press(BUTTON_ID_UP);
+  CHECK(strstr(shown_text(), "Yverdon-les-Bains, Gare : ") == shown_text());
+  CHECK(strstr(shown_text(), "\nin ") != NULL);
+}
+
+static const Test s_tests[] = {
+  { "launch",                       test_launch },
+  { "answer_shown",                 test_answer_shown },
+  { "answer_shown_unassigned",      test_answer_shown_unassigned },
+  { "long_answer_cut",              test_long_answer_cut },
+  { "redraw_on_change",             test_redraw_on_change },
+  { "answer_cached",                test_answer_cached },
+  { "neighbours_prefetched",        test_neighbours_prefetched },
+  { "config_migrated",              test_config_migrated },
+  { "config_blobs",                 test_config_blobs },
+  { "config_written_on_change",     test_config_written_on_change },
+  { "screens_resized",              test_screens_resized },
+  { "services_follow_screen",       test_services_follow_screen },
+  { "worker_handshake",             test_worker_handshake },
+  { "outbox_retry",                 test_outbox_retry },
+  { "weather_bundle",               test_weather_bundle },
+  { "stats_dump",                   test_stats_dump },
+  { "handlers_stay_in_ram",         test_handlers_stay_in_ram },
+  { "menu_keeps_heap",              test_menu_keeps_heap },
+  { "malformed_answers",            test_malformed_answers },
+  { "navigation_stops",             test_navigation_stops },
+  { "navigation_stop_acknowledged", test_navigation_stop_acknowledged },
+  { "transport_countdown",          test_transport_countdown },
+  { "tick_screens_switch",          test_tick_screens_switch },
+};
+
+// Runs a test in a child process, which exits with the number of checks
+// that failed
+static bool test_run(const Test *test) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    stub_reset();
+    stub_worker_set(worker_init, worker_deinit);
+    test->run();
+    fflush(stdout);
+    _exit(s_failures > 255 ? 255 : s_failures);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+    printf("FAIL %s: could not run\n", test->name);
+    return false;
+  }
+  if (WIFSIGNALED(status)) {
+    printf("FAIL %s: signal %d\n", test->name, WTERMSIG(status));
+    return false;
+  }
+  if (WEXITSTATUS(status) != 0) {
+    printf("FAIL %s: %d checks\n", test->name, WEXITSTATUS(status));
+    return false;
+  }
+  printf("ok   %s\n", test->name);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *filter = argc > 1 ? argv[1] : NULL;
+  int run = 0, failed = 0;
+  for (size_t i = 0; i < sizeof(s_tests) / sizeof(s_tests[0]); i++) {
+    if (filter && strncmp(s_tests[i].name, filter, strlen(filter)) != 0) {
+      continue;
+    }
+    run++;
+    failed += !test_run(&s_tests[i]);
+  }
+  printf("%d tests, %d failed\n", run, failed);
+  return failed ? 1 : 0;
+}
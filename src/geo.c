@@ -0,0 +1,161 @@
+#include <pebble.h>
+#include "geo.h"
+
+#define GEO_DEGREE          1000000     // Millionths
+#define GEO_PI              1686629713  // π in Q29 radians, the unit of geo_atan2
+#define GEO_DEGREES_Q16     3754937     // 180 / π in Q16
+#define GEO_MICRODEGREES    57295780    // 180 000 000 / π
+#define GEO_CORDIC_STEPS    30
+
+// sin of 0 to 90 degrees, in GEO_ONE units
+static const int32_t s_sin_table[91] = {
+  0, 18739379, 37473049, 56195305, 74900443, 93582766,
+  112236583, 130856211, 149435979, 167970228, 186453311, 204879599,
+  223243478, 241539355, 259761657, 277904834, 295963357, 313931728,
+  331804471, 349576144, 367241333, 384794656, 402230767, 419544355,
+  436730145, 453782903, 470697435, 487468587, 504091252, 520560366,
+  536870912, 553017922, 568996477, 584801711, 600428808, 615873009,
+  631129609, 646193961, 661061475, 675727625, 690187940, 704438018,
+  718473518, 732290163, 745883746, 759250125, 772385229, 785285058,
+  797945680, 810363241, 822533958, 834454122, 846120104, 857528349,
+  868675383, 879557810, 890172315, 900515665, 910584710, 920376381,
+  929887697, 939115760, 948057759, 956710970, 965072759, 973140576,
+  980911966, 988384560, 995556083, 1002424350, 1008987269, 1015242840,
+  1021189159, 1026824413, 1032146887, 1037154959, 1041847103, 1046221891,
+  1050277989, 1054014162, 1057429273, 1060522280, 1063292242, 1065738315,
+  1067859754, 1069655912, 1071126243, 1072270298, 1073087729, 1073578288,
+  1073741824
+};
+
+// atan(2^-i), Q29 radians
+static const int32_t s_atan_table[GEO_CORDIC_STEPS] = {
+  421657428, 248918915, 131521918, 66762579, 33510843, 16771758,
+  8387925, 4194219, 2097141, 1048575, 524288, 262144,
+  131072, 65536, 32768, 16384, 8192, 4096,
+  2048, 1024, 512, 256, 128, 64,
+  32, 16, 8, 4, 2, 1
+};
+
+// Sine of an angle in units of 1 / degree of a degree, from the table of
+// whole degrees, linear in between
+static int32_t geo_sin_units(int32_t angle, int32_t degree) {
+  int32_t a = angle % (360 * degree);
+  int32_t sign = 1;
+  if (a < 0) {
+    a += 360 * degree;
+  }
+  if (a >= 180 * degree) {
+    a -= 180 * degree;
+    sign = -1;
+  }
+  if (a > 90 * degree) {
+    a = 180 * degree - a;
+  }
+  int32_t i = a / degree;
+  int32_t value = s_sin_table[i];
+  if (i < 90) {
+    value += (int64_t)(s_sin_table[i + 1] - value) * (a % degree) / degree;
+  }
+  return sign * value;
+}
+
+int32_t geo_sin(int32_t angle) {
+  return geo_sin_units(angle, GEO_DEGREE);
+}
+
+int32_t geo_cos(int32_t angle) {
+  return geo_sin(angle % (360 * GEO_DEGREE) + 90 * GEO_DEGREE);
+}
+
+// Square root of a Q60 value, in Q30
+static uint32_t geo_sqrt(uint64_t value) {
+  uint64_t root = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  for (; bit; bit >>= 2) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+  return root;
+}
+
+// Angle of (x, y) in Q29 radians, -π to π, by CORDIC vectoring. |x| and |y|
+// up to 2^31, scaled up so that the last steps still move the vector.
+static int32_t geo_atan2(int64_t y, int64_t x) {
+  int32_t angle = 0;
+  if (x < 0) {
+    angle = y >= 0 ? GEO_PI : -GEO_PI;
+    x = -x;
+    y = -y;
+  }
+  x *= 1 << 28;
+  y *= 1 << 28;
+  for (int i = 0; i < GEO_CORDIC_STEPS; i++) {
+    int64_t dx = y >> i;
+    int64_t dy = x >> i;
+    if (y > 0) {
+      x += dx;
+      y -= dy;
+      angle += s_atan_table[i];
+    } else if (y < 0) {
+      x -= dx;
+      y += dy;
+      angle -= s_atan_table[i];
+    }
+  }
+  return angle;
+}
+
+int32_t geo_asin(int32_t value) {
+  int64_t v = value > GEO_ONE ? GEO_ONE : value < -GEO_ONE ? -GEO_ONE : value;
+  int32_t angle = geo_atan2(v, geo_sqrt(((uint64_t)1 << 60) - v * v));
+  return ((int64_t)angle * GEO_MICRODEGREES + (1 << 28)) >> 29;
+}
+
+int32_t geo_acos(int32_t value) {
+  return 90 * GEO_DEGREE - geo_asin(value);
+}
+
+void geo_distance_bearing(const GeoPoint *from, const GeoPoint *to, int32_t *distance, int16_t *bearing) {
+  int32_t d_lat = to->lat - from->lat;
+  int32_t d_lon = to->lon - from->lon;
+  if (d_lon > 180 * GEO_DEGREE) {
+    d_lon -= 360 * GEO_DEGREE;
+  } else if (d_lon < -180 * GEO_DEGREE) {
+    d_lon += 360 * GEO_DEGREE;
+  }
+  int64_t cos_from = geo_cos(from->lat);
+  int64_t cos_to = geo_cos(to->lat);
+  // Half angles in half millionths, as halving would drop up to 5 cm
+  int64_t half_lat = geo_sin_units(d_lat, 2 * GEO_DEGREE);
+  int64_t half_lon = geo_sin_units(d_lon, 2 * GEO_DEGREE);
+
+  // a = sin²(Δφ/2) + cos φ1 cos φ2 sin²(Δλ/2) in Q60, c = 2 atan2(√a, √(1 - a))
+  uint64_t a = half_lat * half_lat + (half_lon * cos_from >> 30) * (half_lon * cos_to >> 30);
+  if (a > (uint64_t)1 << 60) {
+    a = (uint64_t)1 << 60;
+  }
+  int64_t c = 2 * (int64_t)geo_atan2(geo_sqrt(a), geo_sqrt(((uint64_t)1 << 60) - a));
+  *distance = (c * GEO_EARTH_RADIUS_M + (1 << 28)) >> 29;
+
+  // θ = atan2(sin Δλ cos φ2, cos φ1 sin φ2 - sin φ1 cos φ2 cos Δλ), the
+  // second term as sin Δφ + sin φ1 cos φ2 2 sin²(Δλ/2) so that short ways
+  // do not subtract two close values
+  int64_t y = geo_sin(d_lon) * cos_to >> 30;
+  int64_t x = geo_sin(from->lat) * cos_to >> 30;
+  x = (x * half_lon >> 30) * half_lon >> 29;
+  x += geo_sin(d_lat);
+  int32_t degrees = ((int64_t)geo_atan2(y, x) * GEO_DEGREES_Q16 + ((int64_t)1 << 44)) >> 45;
+  if (degrees < 0) {
+    degrees += 360;
+  } else if (degrees >= 360) {
+    degrees -= 360;
+  }
+  *bearing = degrees;
+}
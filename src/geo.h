@@ -0,0 +1,29 @@
+#pragma once
+
+#include <pebble.h>
+
+// Distance and bearing between two positions, in integers only as the watch
+// has no FPU. Coordinates are in millionths of a degree, as the phone sends
+// them (KEY_LATITUDE, KEY_LONGITUDE).
+
+#define GEO_EARTH_RADIUS_M  6371000
+#define GEO_ONE             (1 << 30)   // 1.0 of geo_sin and geo_cos
+
+typedef struct {
+  int32_t lat;
+  int32_t lon;
+} GeoPoint;
+
+// Sine and cosine of an angle in millionths of a degree, in GEO_ONE units
+int32_t geo_sin(int32_t angle);
+int32_t geo_cos(int32_t angle);
+
+// Arcsine and arccosine of a value in GEO_ONE units, in millionths of a
+// degree, the value clamped to -GEO_ONE to GEO_ONE
+int32_t geo_asin(int32_t value);
+int32_t geo_acos(int32_t value);
+
+// Great circle distance in m by the haversine formula, and initial bearing
+// in degrees clockwise from north (0 to 359), from one point to the other.
+// Rounded to the metre and the degree, the distance within 0.02 % beyond.
+void geo_distance_bearing(const GeoPoint *from, const GeoPoint *to, int32_t *distance, int16_t *bearing);
@@ -1,8 +1,22 @@
 #include <pebble.h>
+#include "trace.h"
+#include "geo.h"
+#include "sun.h"
+#include "../worker_src/activity.h"
 
-static Window *main_window, *s_menu_window, *config_window;
+// Define to log a trace of the session (see trace.h)
+// #define TRACE_RECORD
+
+// Define to count the wakeups of every handler and the time they take, shown
+// by the diagnostics window and logged at exit
+// #define PROFILE
+
+static Window *main_window, *s_menu_window, *config_window, *s_diag_window;
 static MenuLayer *s_menu_layer;
-TextLayer *output_layer, *number_layer;
+Layer *output_layer;
+TextLayer *number_layer;
+static TextLayer *config_output_layer, *config_number_layer, *s_diag_layer;
+static bool s_main_stale = false;     // Menu shown over the main window since its last update
 
 #define SCREEN_TEXT_GAP 14
 
@@ -26,6 +40,10 @@ TextLayer *output_layer, *number_layer;
 
 #define NUMBER_OF_ITEMS                16
 
+// Every weather field (KEY_STATUS to KEY_SUNSET) in one answer, asked for
+// any weather item. Not an item itself.
+#define REQUEST_WEATHER_ALL            16
+
 
 // Pebble KEY
 #define PEBBLE_KEY_VALUE        1
@@ -34,6 +52,9 @@ TextLayer *output_layer, *number_layer;
 #define KEY_LONGITUDE       101
 #define KEY_DISTANCE        102
 #define KEY_DIRECTION       103
+#define KEY_NAV_DELTA       104     // Navigation frame : seq, int16 LE distance, int8 bearing
+#define KEY_NAV_INTERVAL    105     // ms between navigation frames, asked with the start
+#define KEY_NAV_POSITIONS   106     // Asked with the start : frames of KEY_LATITUDE and KEY_LONGITUDE
 // Elevation API
 #define KEY_ALTITUDE        200
 // Weather API
@@ -46,626 +67,2016 @@ TextLayer *output_layer, *number_layer;
 #define KEY_WIND_DIRECTION  306
 #define KEY_SUNRISE         307
 #define KEY_SUNSET          308
+#define KEY_WEATHER_DATA    309     // int32 LE of KEY_TEMPERATURE..KEY_SUNSET
 // Transport API
 #define KEY_DEPARTURE       400
 #define KEY_DEPARTURE_TIME  401
 #define KEY_ARRIVAL         402
 #define KEY_ARRIVAL_TIME    403
+#define KEY_TRANSPORT_COUNT 404     // Connections asked with the request
+#define KEY_TIMETABLE       405     // uint32 LE departure and arrival time of each connection
+
+#define KEY_STATS           500     // Asked by the phone, answered with stats_dump
 
 
 #define MAX_TEXT_SIZE       128
-#define NUM_ACCEL_SAMPLES   10
-#define GRAVITY             10000 // (1g)² = 10000
-#define ACCEL_THRESHOLD     8000  // (1g)² = 10000
+#define MAX_RESPONSE_KEYS   4
+#define NUMBER_OF_SCREENS   4       // On first launch
+#define MAX_SCREENS         16
+#define OUTBOX_QUEUE_SIZE   8
+#define OUTBOX_MAX_RETRIES  3
+#define OUTBOX_RETRY_MS     250     // Doubled after every failure
+#define NUM_WEATHER_FIELDS  (KEY_SUNSET - KEY_STATUS + 1)
+#define WEATHER_FIELD_SIZE  32
+#define PREFETCH_MIN_BATTERY 20     // %, below it neighbours are not prefetched
+#define INBOX_SIZE          512     // Largest answer : transport with long names
+#define OUTBOX_SIZE         128     // One request id, or the stats dump
+#define NAV_INTERVAL_MS     1000    // Frame period asked of the phone
+#define NAV_RENDER_MS       500     // Min time between two navigation redraws
+#define NAV_FIX_INTERVAL_MS 5000    // Position period asked when the watch has the target
+#define NAV_EXTRAPOLATE_MS  10000   // Max time the position is moved on after a fix
+#define TIMETABLE_SIZE      8       // Connections asked in one transport answer
+#define TIMETABLE_LOW       2       // Connections left when the next ones are asked
+#define TIMETABLE_MOVE_M    1000    // Distance from where it was asked that makes it stale
+#define TIMETABLE_NAME_SIZE 32
+
+// Where the value of an item comes from
+typedef enum {
+  SOURCE_WATCH,     // Computed by a LocalService
+  SOURCE_PHONE,     // Own request to the phone
+  SOURCE_WEATHER    // Field of the REQUEST_WEATHER_ALL answer
+} RequestSource;
+
+// Watch service feeding the items that are computed locally
+typedef enum {
+  SERVICE_NONE,
+  SERVICE_TICK,
+  SERVICE_ACTIVITY, // Totals of the activity worker
+  SERVICE_BATTERY,
+  SERVICE_NAV       // Navigation stream of the phone
+} LocalService;
 
 typedef struct {
-  char name[16];  // Name of this tea
-} ScreenInfo;
+  const char *label;                  // Name shown in the config window
+  const char *format;                 // Display of the answer, one %s per key
+  uint32_t keys[MAX_RESPONSE_KEYS];   // Keys of the answer, in format order
+  uint8_t num_keys;
+  RequestSource source;
+  LocalService service;
+  uint16_t ttl;                       // Default s before an answer is asked again
+} RequestInfo;
+
+// Every item that can be assigned to a screen, indexed by request id
+static const RequestInfo s_requests[NUMBER_OF_ITEMS] = {
+  // Location API
+  [REQUEST_LOCATION]                = { "LOCATION", "lat : %s\nlon : %s",
+                                        { KEY_LATITUDE, KEY_LONGITUDE }, 2, SOURCE_PHONE, SERVICE_NONE, 30 },
+  [REQUEST_FIX_LOCATION]            = { "FIXING TARGET", NULL, { 0 }, 0, SOURCE_PHONE, SERVICE_NONE, 0 },
+  [REQUEST_START_THREADED_LOCATION] = { "START THREAD NAVIGATION", "distance : %s\ndirection : %s",
+                                        { KEY_DISTANCE, KEY_DIRECTION }, 2, SOURCE_WATCH, SERVICE_NAV, 0 },
+  [REQUEST_STOP_THREADED_LOCATION]  = { "STOP THREAD NAVIGATION", NULL, { 0 }, 0, SOURCE_PHONE, SERVICE_NONE, 0 },
+  // Elevation API
+  [REQUEST_ELEVATION]               = { "ELEVATION", "altitude : %sm",
+                                        { KEY_ALTITUDE }, 1, SOURCE_PHONE, SERVICE_NONE, 300 },
+  // Weather API
+  [REQUEST_WEATHER_STATUS]          = { "WEATHER_STATUS", "%s\n%s",
+                                        { KEY_STATUS, KEY_DESCRIPTION }, 2, SOURCE_WEATHER, SERVICE_NONE, 600 },
+  [REQUEST_WEATHER_TEMPERATURE]     = { "TEMPERATURE", "%s°C",
+                                        { KEY_TEMPERATURE }, 1, SOURCE_WEATHER, SERVICE_NONE, 600 },
+  [REQUEST_WEATHER_PRESSURE]        = { "PRESSURE", "pressure : %s",
+                                        { KEY_PRESSURE }, 1, SOURCE_WEATHER, SERVICE_NONE, 600 },
+  [REQUEST_WEATHER_HUMIDITY]        = { "HUMIDITY", "humidity : %s",
+                                        { KEY_HUMIDITY }, 1, SOURCE_WEATHER, SERVICE_NONE, 600 },
+  [REQUEST_WEATHER_WIND]            = { "WIND", "wind speed : %skm/h\nwind direction : %s",
+                                        { KEY_WIND_SPEED, KEY_WIND_DIRECTION }, 2, SOURCE_WEATHER, SERVICE_NONE, 600 },
+  [REQUEST_WEATHER_SUNRISE]         = { "SUNRISE", "sunrise : \n%s",
+                                        { KEY_SUNRISE }, 1, SOURCE_WEATHER, SERVICE_NONE, 21600 },
+  [REQUEST_WEATHER_SUNSET]          = { "SUNSET", "sunset : \n%s",
+                                        { KEY_SUNSET }, 1, SOURCE_WEATHER, SERVICE_NONE, 21600 },
+  // Transport API
+  [REQUEST_TRANSPORT]               = { "TRANSPORT", "%s : %s\n%s : %s",
+                                        { KEY_DEPARTURE, KEY_DEPARTURE_TIME, KEY_ARRIVAL, KEY_ARRIVAL_TIME }, 4,
+                                        SOURCE_PHONE, SERVICE_TICK, 60 },
+  // Computed on the watch
+  [SHOW_UP_TIME]                    = { "SHOW_UP_TIME", NULL, { 0 }, 0, SOURCE_WATCH, SERVICE_TICK, 0 },
+  [SHOW_ACTIVE_TIME]                = { "SHOW_ACTIVE_TIME", NULL, { 0 }, 0, SOURCE_WATCH, SERVICE_ACTIVITY, 0 },
+  [SHOW_BATTERY_STATE]              = { "SHOW_BATTERY_STATE", NULL, { 0 }, 0, SOURCE_WATCH, SERVICE_BATTERY, 0 }
+};
 
 enum {
-  PERSIST_SCREEN1,
+  PERSIST_SCREEN1,  // Legacy, one item per key, migrated into PERSIST_CONFIG
   PERSIST_SCREEN2,
   PERSIST_SCREEN3,
-  PERSIST_SCREEN4
+  PERSIST_SCREEN4,
+  PERSIST_CONFIG,
+  PERSIST_TARGET,   // GeoPoint fixed by REQUEST_FIX_LOCATION
+  PERSIST_SUN       // SunPlace
 };
 
+#define CONFIG_VERSION      2
 
-ScreenInfo screen_array[] = {
-   {"SCREEN 1"},
-   {"SCREEN 2"},
-   {"SCREEN 3"},
-   {"SCREEN 4"}
-};
+// Settings kept in flash as one blob under PERSIST_CONFIG, read once at init
+// and written back only when changed. Every change of the fields bumps the
+// version, and the older versions keep their layout for config_load.
+typedef struct {
+  uint8_t version;
+  uint8_t num_screens;
+  int8_t screens[MAX_SCREENS];          // Item of each screen, -1 for none
+  uint8_t still_rate;                   // AccelSamplingRate, wearer still
+  uint8_t moving_rate;                  // AccelSamplingRate, wearer moving
+  uint16_t ttl[NUMBER_OF_ITEMS];        // s before an answer is asked again
+} Config;
 
-int currentScreen = 0;
+// Version 1, four screens
+typedef struct {
+  uint8_t version;
+  int8_t screens[4];
+  uint8_t still_rate;
+  uint8_t moving_rate;
+  uint16_t ttl[NUMBER_OF_ITEMS];
+} ConfigV1;
 
-int counter = -1;
+int currentScreen = 0;
 
 int nbItem = 0;
 
 char text[MAX_TEXT_SIZE];
 char window_number[MAX_TEXT_SIZE];
-unsigned long int up_time = 0;      //in seconds
-unsigned long int active_time = 0;  //in seconds/10
+time_t launch_time = 0;
+unsigned long int active_time = 0;  //in s, counted by the worker
+
+// Minutes active from the worker history
+static struct {
+  uint16_t today;
+  uint16_t yesterday;
+  uint16_t week;      // Last 7 days, today included
+} s_activity;
+
+// Target of the navigation, the position the phone had when fixed
+static GeoPoint s_target;
+static bool s_target_set = false;
+
+
+static Config s_config;
+static bool s_config_dirty = false;
 
 static char s_screen_text[32];
 
-// menu select
-static void select_callback(struct MenuLayer *s_menu_layer, MenuIndex *cell_index, 
-                            void *callback_context) {
+// Last answer of the phone item of each screen, displayed as soon as the
+// screen is shown while a fresh one is asked for. Weather items are built
+// from s_weather instead. Preallocated for MAX_SCREENS so changing the
+// number of screens never touches the heap.
+typedef struct {
+  time_t time;      // Arrival of the answer, 0 if none
+  char text[MAX_TEXT_SIZE];
+} Screen;
+
+static Screen s_screen_pool[MAX_SCREENS];
+
+// The main window output is drawn by its own layer, which keeps a copy of
+// the text on screen. Setting the same text again does not mark it dirty,
+// and the firmware draws the changes of one event in a single frame.
+typedef struct {
+  char text[MAX_TEXT_SIZE];
+} OutputData;
 
-  // Switch to config window
-  currentScreen = cell_index->row;
-  window_stack_push(config_window, false);
+static void output_update_proc(Layer *layer, GContext *ctx) {
+  OutputData *data = layer_get_data(layer);
+  GRect bounds = layer_get_bounds(layer);
+  graphics_context_set_fill_color(ctx, GColorWhite);
+  graphics_fill_rect(ctx, bounds, 0, GCornerNone);
+  graphics_context_set_text_color(ctx, GColorBlack);
+  graphics_draw_text(ctx, data->text, fonts_get_system_font(FONT_KEY_GOTHIC_14_BOLD), bounds,
+                     GTextOverflowModeWordWrap, GTextAlignmentCenter, NULL);
 }
 
-static void back_callback(struct MenuLayer *s_menu_layer, MenuIndex *cell_index, 
-                            void *callback_context) {
-  strcpy(text, "");
-  text_layer_set_text(output_layer, text);
-  window_stack_pop(true);   
+static void output_set_text(const char *value) {
+  OutputData *data = layer_get_data(output_layer);
+  if (strncmp(data->text, value, MAX_TEXT_SIZE - 1) == 0) {
+    return;
+  }
+  strncpy(data->text, value, MAX_TEXT_SIZE - 1);
+  data->text[MAX_TEXT_SIZE - 1] = '\0';
+  layer_mark_dirty(output_layer);
 }
 
+static void screens_resize(int num_screens);
+uint16_t num_rows_callback(MenuLayer *menu_layer, uint16_t section_index, void *callback_context);
 
-void send(int key, char *value) {
-  DictionaryIterator *iter;
-  app_message_outbox_begin(&iter);
-  dict_write_cstring(iter, key, value);
-  app_message_outbox_send();
+static uint32_t clock_ms(void) {
+  time_t seconds;
+  uint16_t ms = time_ms(&seconds, NULL);
+  return (uint32_t)seconds * 1000 + ms;
 }
 
-void tick_handler(struct tm *tick_time, TimeUnits units_changed) {
-  if (counter ==  SHOW_UP_TIME) {
-    // Get time since launch
-    int seconds = up_time % 60;
-    int minutes = (up_time % 3600) / 60;
-    int hours = up_time / 3600;
-
-    snprintf(text, MAX_TEXT_SIZE, "Uptime:\n%dh %dm %ds", hours, minutes, seconds);
-    text_layer_set_text(output_layer, text);
-  }
-  else if (counter == SHOW_BATTERY_STATE) {
-    BatteryChargeState charge_state = battery_state_service_peek();
+#ifdef TRACE_RECORD
+#ifndef TRACE_SINK
+#define TRACE_SINK trace_log
+#define TRACE_ENABLED() true
 
-    if (charge_state.is_charging) {
-      snprintf(text, MAX_TEXT_SIZE, "Battery is charging");
+// Logs the trace bytes in hex, short lines so the log does not cut them
+static void trace_log(const void *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  char line[2 * 32 + 1];
+  const uint8_t *bytes = data;
+  while (size > 0) {
+    size_t count = size < 32 ? size : 32;
+    for (size_t i = 0; i < count; i++) {
+      line[2 * i] = digits[bytes[i] >> 4];
+      line[2 * i + 1] = digits[bytes[i] & 0xF];
     }
-    else {
-      snprintf(text, MAX_TEXT_SIZE, "Battery is\n%d%% charged", charge_state.charge_percent);
-    }
-    text_layer_set_text(output_layer, text);
-  }  
-  
-  // Increment uptime
-  up_time++;
+    line[2 * count] = '\0';
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "TRACE %s", line);
+    bytes += count;
+    size -= count;
+  }
 }
+#endif
 
- 
-uint16_t num_rows_callback(MenuLayer *menu_layer, uint16_t section_index, void *callback_context)
-{
-  return 4;
-}
+static bool s_trace_started = false;
+static uint32_t s_trace_start_ms;
 
-static void draw_row_handler(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, 
-                             void *callback_context) {
-  char* name = screen_array[cell_index->row].name;
+static void trace_record(TraceType type, const void *payload, uint16_t size) {
+  if (!TRACE_ENABLED()) {
+    return;
+  }
+  uint32_t now = clock_ms();
+  if (!s_trace_started) {
+    s_trace_started = true;
+    s_trace_start_ms = now;
+    TRACE_SINK(TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  }
+  uint32_t elapsed = now - s_trace_start_ms;
+  uint8_t header[TRACE_HEADER_SIZE] = { elapsed, elapsed >> 8, elapsed >> 16, elapsed >> 24,
+                                        type, size, size >> 8 };
+  TRACE_SINK(header, TRACE_HEADER_SIZE);
+  TRACE_SINK(payload, size);
+}
 
-  menu_cell_basic_draw(ctx, cell_layer, name, NULL, NULL);
+static void trace_dictionary(TraceType type, const DictionaryIterator *iter) {
+  trace_record(type, iter->dictionary, (const uint8_t *)iter->end - (const uint8_t *)iter->dictionary);
 }
 
-static int16_t get_cell_height_callback(MenuLayer *menu_layer, MenuIndex *cell_index, 
-                                        void *callback_context) {
-  return 60;
+static void trace_worker(uint16_t type, const AppWorkerMessage *data) {
+  uint16_t fields[] = { type, data->data0, data->data1, data->data2 };
+  uint8_t payload[sizeof(fields)];
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    payload[2 * i] = fields[i];
+    payload[2 * i + 1] = fields[i] >> 8;
+  }
+  trace_record(TRACE_WORKER, payload, sizeof(payload));
 }
 
-static void menu_window_load(Window *window) {
-  Layer *window_layer = window_get_root_layer(window);
-  GRect bounds = layer_get_bounds(window_layer);
+static void trace_outbox_done(AppMessageResult result) {
+  uint8_t payload[4] = { result, result >> 8, result >> 16, result >> 24 };
+  trace_record(TRACE_OUTBOX_DONE, payload, sizeof(payload));
+}
 
-  s_menu_layer = menu_layer_create(bounds);
-  menu_layer_set_callbacks(s_menu_layer, NULL, (MenuLayerCallbacks){
-    .get_num_rows = num_rows_callback,
-    .get_cell_height = get_cell_height_callback,
-    .draw_row = draw_row_handler,
-    .select_click = select_callback
-  }); 
-  menu_layer_set_click_config_onto_window(s_menu_layer,	window);
-  layer_add_child(window_layer, menu_layer_get_layer(s_menu_layer));
+static void trace_click(ButtonId button) {
+  uint8_t payload = button;
+  trace_record(TRACE_CLICK, &payload, 1);
 }
 
-static void menu_window_unload(Window *window) {
-  menu_layer_destroy(s_menu_layer);
+static void trace_persist(uint32_t key, const void *data, size_t size) {
+  uint8_t payload[4 + PERSIST_DATA_MAX_LENGTH] = { key, key >> 8, key >> 16, key >> 24 };
+  memcpy(payload + 4, data, size);
+  trace_record(TRACE_PERSIST, payload, 4 + size);
 }
+#else
+#define trace_persist(key, data, size)
+#define trace_dictionary(type, iter)
+#define trace_worker(type, data)
+#define trace_outbox_done(result)
+#define trace_click(button)
+#endif
 
+#ifdef PROFILE
+// Handlers timed by the profiler, each one a wakeup of the app
+typedef enum {
+  PROFILE_TICK,
+  PROFILE_WORKER,
+  PROFILE_INBOX,
+  PROFILE_OUTBOX,
+  PROFILE_CLICK,
+  PROFILE_BATTERY,
+  PROFILE_TIMER,
+  PROFILE_COUNT
+} ProfileHandler;
 
-static void data_handler(AccelData *data, uint32_t num_samples) {  // accel from -4000 to 4000, 1g = 1000 cm/s²
-  if (counter == SHOW_ACTIVE_TIME) {
-    int i, x, y, z, acc_norm_2;
-    for (i = 0; i < NUM_ACCEL_SAMPLES; i++) {
-                                             // Divide by 10 to avoid too high values. Now from -400 to 400
-      x = data[i].x / 10;                    // accel in dm/s²
-      y = data[i].y / 10;                    // accel in dm/s²
-      z = data[i].z / 10;                    // accel in dm/s²
-                                             // 1g = 100 dm/s²  
-      acc_norm_2 = (x*x) + (y*y) + (z*z);    // (1g)² = 10000
-      //APP_LOG(APP_LOG_LEVEL_INFO, "%d %d %d %d", x, y, z, acc_norm_2);
-      if ( ((acc_norm_2 - GRAVITY) > ACCEL_THRESHOLD) || ((GRAVITY - acc_norm_2) > ACCEL_THRESHOLD) ) {
-        active_time++;
-      }
-    }
-    
-    int active_time_s = active_time / 10;
-    int seconds = active_time_s % 60;
-    int minutes = (active_time_s % 3600) / 60;
-    int hours = active_time_s / 3600;
+#define PROFILE_RING_SIZE   64
+
+static const char *const s_profile_names[PROFILE_COUNT] = {
+  "tick", "worker", "inbox", "outbox", "click", "battery", "timer"
+};
+
+typedef struct {
+  uint32_t calls;
+  uint32_t ms;            // Cumulated, at the ms resolution of time_ms
+  uint16_t max_ms;
+} ProfileCounter;
+
+// One call, in the ring of the last PROFILE_RING_SIZE calls
+typedef struct {
+  uint32_t start_ms;      // Since launch
+  uint16_t elapsed_ms;
+  uint8_t handler;
+} ProfileEvent;
 
-    snprintf(text, MAX_TEXT_SIZE, "Active time:\n%dh %dm %ds", hours, minutes, seconds);
-    text_layer_set_text(output_layer, text);
+static ProfileCounter s_profile[PROFILE_COUNT];
+static ProfileEvent s_profile_ring[PROFILE_RING_SIZE];
+static uint32_t s_profile_events = 0;
+
+static void profile_record(ProfileHandler handler, uint32_t start) {
+  uint32_t elapsed = clock_ms() - start;
+  uint16_t elapsed_ms = elapsed < UINT16_MAX ? elapsed : UINT16_MAX;
+  ProfileCounter *counter = &s_profile[handler];
+  counter->calls++;
+  counter->ms += elapsed;
+  if (elapsed_ms > counter->max_ms) {
+    counter->max_ms = elapsed_ms;
   }
+  s_profile_ring[s_profile_events++ % PROFILE_RING_SIZE] = (ProfileEvent) {
+    .start_ms = start - (uint32_t)launch_time * 1000, .elapsed_ms = elapsed_ms, .handler = handler
+  };
 }
 
-void received_handler(DictionaryIterator *iter, void *context) {
-  Tuple *result_tuple = dict_find(iter, PEBBLE_KEY_VALUE);
-  switch(result_tuple->value->int32) {
-    // Location API
-    case REQUEST_LOCATION:
-      strcpy(text, "lat : ");
-      strcat(text, dict_find(iter, KEY_LATITUDE)->value->cstring);
-      strcat(text, "\nlon : ");
-      strcat(text, dict_find(iter, KEY_LONGITUDE)->value->cstring);
-      break;
-    case REQUEST_START_THREADED_LOCATION:
-      strcpy(text, "distance : ");
-      strcat(text, dict_find(iter, KEY_DISTANCE)->value->cstring);
-      strcat(text, "\ndirection : ");
-      strcat(text, dict_find(iter, KEY_DIRECTION)->value->cstring);
-      break;
-    // Elevation API
-    case REQUEST_ELEVATION:
-      strcpy(text, "altitude : ");
-      strcat(text, dict_find(iter, KEY_ALTITUDE)->value->cstring);
-      strcat(text, "m");
-      break;
-    // Weather API
-    case REQUEST_WEATHER_STATUS:
-      strcpy(text, dict_find(iter, KEY_STATUS)->value->cstring);
-      strcat(text, "\n");
-      strcat(text, dict_find(iter, KEY_DESCRIPTION)->value->cstring);
-      break;
-    case REQUEST_WEATHER_TEMPERATURE:
-      strcpy(text, dict_find(iter, KEY_TEMPERATURE)->value->cstring);
-      strcat(text, "°C");
-      break;
-    case REQUEST_WEATHER_PRESSURE:
-      strcpy(text, "pressure : ");
-      strcat(text, dict_find(iter, KEY_PRESSURE)->value->cstring);
-      break;
-    case REQUEST_WEATHER_HUMIDITY:
-      strcpy(text, "humidity : ");
-      strcat(text, dict_find(iter, KEY_HUMIDITY)->value->cstring);
-      break;
-    case REQUEST_WEATHER_WIND:
-      strcpy(text, "wind speed : ");
-      strcat(text, dict_find(iter, KEY_WIND_SPEED)->value->cstring);
-      strcat(text, "km/h\nwind direction : ");
-      strcat(text, dict_find(iter, KEY_WIND_DIRECTION)->value->cstring);
-      break;
-    case REQUEST_WEATHER_SUNRISE:
-      strcpy(text, "sunrise : \n");
-      strcat(text, dict_find(iter, KEY_SUNRISE)->value->cstring);
-      break;
-    case REQUEST_WEATHER_SUNSET:
-      strcpy(text, "sunset : \n");
-      strcat(text, dict_find(iter, KEY_SUNSET)->value->cstring);
-      break;
-    // Transport API
-    case REQUEST_TRANSPORT:
-      strcpy(text, dict_find(iter, KEY_DEPARTURE)->value->cstring);
-      strcat(text, " : ");
-      strcat(text, dict_find(iter, KEY_DEPARTURE_TIME)->value->cstring);
-      strcat(text, "\n");
-      strcat(text, dict_find(iter, KEY_ARRIVAL)->value->cstring);
-      strcat(text, " : ");
-      strcat(text, dict_find(iter, KEY_ARRIVAL_TIME)->value->cstring);
-      break;
-    default:
-      strcpy(text, "Error.\nPlease check your dictionary KEYS");
-      break;
+// Counters, then the ring from the oldest call, as "PROFILE" lines
+static void profile_log(void) {
+  for (int i = 0; i < PROFILE_COUNT; i++) {
+    APP_LOG(APP_LOG_LEVEL_INFO, "PROFILE %s calls %lu ms %lu max %u", s_profile_names[i],
+            (unsigned long)s_profile[i].calls, (unsigned long)s_profile[i].ms, s_profile[i].max_ms);
+  }
+  uint32_t first = s_profile_events > PROFILE_RING_SIZE ? s_profile_events - PROFILE_RING_SIZE : 0;
+  for (uint32_t i = first; i < s_profile_events; i++) {
+    const ProfileEvent *event = &s_profile_ring[i % PROFILE_RING_SIZE];
+    APP_LOG(APP_LOG_LEVEL_INFO, "PROFILE at %lu %s %u", (unsigned long)event->start_ms,
+            s_profile_names[event->handler], event->elapsed_ms);
   }
-  text_layer_set_text(output_layer, text);
 }
 
-// Select action
-void select_click_handler(ClickRecognizerRef recognizer, void *context) {
-  strcpy(text, "");
-  text_layer_set_text(output_layer, text);
-  text_layer_set_text(number_layer, text);
-  text_layer_set_background_color(number_layer, GColorWhite);
-  menu_window_load(main_window);
-}
+#define PROFILE_BEGIN()         uint32_t profile_start = clock_ms()
+#define PROFILE_END(handler)    profile_record(handler, profile_start)
+#else
+#define PROFILE_BEGIN()
+#define PROFILE_END(handler)
+#define profile_log()
+#endif
 
-// Up action
-void up_click_config_handler(ClickRecognizerRef recognizer, void *context) {
-  if (nbItem + 1 > 15) {
-    nbItem = 0;
+// menu select
+static void select_callback(struct MenuLayer *s_menu_layer, MenuIndex *cell_index, 
+                            void *callback_context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_SELECT);
+  if (cell_index->row == num_rows_callback(s_menu_layer, 0, NULL) - 1) {
+    window_stack_push(s_diag_window, false);
+  } else if (cell_index->row >= s_config.num_screens) {
+    // Rows after the screens add or remove one
+    bool add = cell_index->row == s_config.num_screens && s_config.num_screens < MAX_SCREENS;
+    screens_resize(s_config.num_screens + (add ? 1 : -1));
+    menu_layer_reload_data(s_menu_layer);
   } else {
-    nbItem = nbItem + 1;
+    // Switch to config window
+    currentScreen = cell_index->row;
+    window_stack_push(config_window, false);
   }
-  //APP_LOG(APP_LOG_LEVEL_INFO, "UP : Sending request id : %d", nbItem);
-  
-  int val = -1;
-  switch(currentScreen) {
-    case 0:
-      if (persist_exists(PERSIST_SCREEN1)) {
-        val = persist_read_int(PERSIST_SCREEN1);
-      }
-    break;
-    case 1:
-      if (persist_exists(PERSIST_SCREEN2)) {
-        val = persist_read_int(PERSIST_SCREEN2);
-      }
-    break;
-    case 2:
-      if (persist_exists(PERSIST_SCREEN3)) {
-      val = persist_read_int(PERSIST_SCREEN3);
-      }
-    break;
-    case 3:
-    if (persist_exists(PERSIST_SCREEN4)) {
-      val = persist_read_int(PERSIST_SCREEN4);
+  PROFILE_END(PROFILE_CLICK);
+}
+
+// Only there to trace the presses that move the menu selection
+static void selection_changed_callback(struct MenuLayer *s_menu_layer, MenuIndex new_index,
+                                       MenuIndex old_index, void *callback_context) {
+  PROFILE_BEGIN();
+  trace_click(new_index.row < old_index.row ? BUTTON_ID_UP : BUTTON_ID_DOWN);
+  PROFILE_END(PROFILE_CLICK);
+}
+
+
+// Round trips to the phone : the time from the send of a request to its
+// answer, counted per request id in fixed buckets, and the messages that
+// went wrong. Shown by the diagnostics window and sent to the phone when it
+// asks with KEY_STATS.
+#define STATS_TYPES         (REQUEST_WEATHER_ALL + 1)
+#define STATS_BUCKETS       8
+#define STATS_TIMEOUT_MS    30000   // No answer by then counts as a timeout
+#define STATS_HEADER_SIZE   16
+
+// Upper bounds in ms of the buckets, the last one takes the rest
+static const uint16_t s_latency_bounds[STATS_BUCKETS - 1] = { 100, 250, 500, 1000, 2000, 5000, 10000 };
+
+typedef struct {
+  uint32_t sent;
+  uint32_t failed;                      // Sends refused or not acknowledged
+  uint32_t dropped;                     // Inbox messages the app could not take
+  uint32_t timeouts;
+  uint32_t waiting;                     // Bit per request id sent and not answered yet
+  uint32_t sent_ms[STATS_TYPES];        // First send of the waiting requests
+  uint16_t latency[STATS_TYPES][STATS_BUCKETS];
+} Stats;
+
+static Stats s_stats;
+
+// Requests that have been waiting too long are given up on
+static void stats_expire(uint32_t now) {
+  for (int id = 0; id < STATS_TYPES; id++) {
+    if ((s_stats.waiting & (1u << id)) && now - s_stats.sent_ms[id] >= STATS_TIMEOUT_MS) {
+      s_stats.waiting &= ~(1u << id);
+      s_stats.timeouts++;
     }
-    break;
   }
-  
-   //APP_LOG(APP_LOG_LEVEL_INFO, "Before UP valid, %d, %d == %d", val, nbItem, val);
-  
-  if (val != -1 && nbItem == val) {
-    text_layer_set_text_color(output_layer, GColorWhite);
-    text_layer_set_background_color(output_layer, GColorBlack);
-    window_set_background_color(config_window, GColorBlack);
-  } else {
-    text_layer_set_text_color(output_layer, GColorBlack);
-    text_layer_set_background_color(output_layer, GColorWhite);
-    window_set_background_color(config_window, GColorWhite);
+}
+
+// A request sent again before its answer, after a failure, keeps the time
+// of its first send so the latency is the one the user waited
+static void stats_sent(int id) {
+  s_stats.sent++;
+  if (id < 0 || id >= STATS_TYPES || (id < NUMBER_OF_ITEMS && !s_requests[id].format)) {
+    return;
   }
- 
-  switch (nbItem) {
-    case REQUEST_LOCATION:
-      strcpy(text, "LOCATION");
-      break;
-    case REQUEST_FIX_LOCATION:
-      strcpy(text, "FIXING TARGET");
-      break;
-    case REQUEST_START_THREADED_LOCATION:
-      strcpy(text, "START THREAD NAVIGATION");
-      break;
-    case REQUEST_STOP_THREADED_LOCATION:
-      strcpy(text, "STOP THREAD NAVIGATION");
-      break;
-    case REQUEST_ELEVATION:
-      strcpy(text, "ELEVATION");
-      break;
-    case REQUEST_WEATHER_STATUS:
-      strcpy(text, "WEATHER_STATUS");
-      break;
-    case REQUEST_WEATHER_TEMPERATURE:
-      strcpy(text, "TEMPERATURE");
-      break;
-    case REQUEST_WEATHER_PRESSURE:
-      strcpy(text, "PRESSURE");
-      break;
-    case REQUEST_WEATHER_HUMIDITY:
-      strcpy(text, "HUMIDITY");
-      break;
-    case REQUEST_WEATHER_WIND:
-      strcpy(text, "WIND");
-      break;
-    case REQUEST_WEATHER_SUNRISE:
-      strcpy(text, "SUNRISE");
-      break;
-    case REQUEST_WEATHER_SUNSET:
-      strcpy(text, "SUNSET");
-      break;
-    case REQUEST_TRANSPORT:
-      strcpy(text, "TRANSPORT");
-      break;
-    case SHOW_UP_TIME:
-      strcpy(text, "SHOW_UP_TIME");
-      break;
-    case SHOW_ACTIVE_TIME:
-      strcpy(text, "SHOW_ACTIVE_TIME");
-      break;
-    case SHOW_BATTERY_STATE:
-      strcpy(text, "SHOW_BATTERY_STATE");
-      break;
-    default:
-      strcpy(text, "Error.\nPlease check if NUMBER_OF_ITEMS is OK");
-      break;
+  uint32_t now = clock_ms();
+  stats_expire(now);
+  if (!(s_stats.waiting & (1u << id))) {
+    s_stats.waiting |= 1u << id;
+    s_stats.sent_ms[id] = now;
   }
-  text_layer_set_text(output_layer, text);
-  text_layer_set_text_alignment(output_layer, GTextAlignmentCenter);
 }
 
-// down click
-void down_click_config_handler(ClickRecognizerRef recognizer, void *context) {
-  if (nbItem - 1 < 0) {
-    nbItem = 15;
-  } else {
-    nbItem = nbItem - 1;
+static void stats_answered(int id) {
+  if (id < 0 || id >= STATS_TYPES || !(s_stats.waiting & (1u << id))) {
+    return;
   }
-  //APP_LOG(APP_LOG_LEVEL_INFO, "DOWN : Sending request id : %d", nbItem);
-  int val = -1;
-  switch(currentScreen) {
-    case 0:
-      if (persist_exists(PERSIST_SCREEN1)) {
-        val = persist_read_int(PERSIST_SCREEN1);
-      }
-    break;
-    case 1:
-      if (persist_exists(PERSIST_SCREEN2)) {
-        val = persist_read_int(PERSIST_SCREEN2);
-      }
-    break;
-    case 2:
-      if (persist_exists(PERSIST_SCREEN3)) {
-      val = persist_read_int(PERSIST_SCREEN3);
-      }
-    break;
-    case 3:
-    if (persist_exists(PERSIST_SCREEN4)) {
-      val = persist_read_int(PERSIST_SCREEN4);
-    }
-    break;
+  s_stats.waiting &= ~(1u << id);
+  uint32_t elapsed = clock_ms() - s_stats.sent_ms[id];
+  if (elapsed >= STATS_TIMEOUT_MS) {
+    s_stats.timeouts++;
+    return;
   }
-  
-  if (val != -1 && nbItem == val) {
-    text_layer_set_text_color(output_layer, GColorWhite);
-    text_layer_set_background_color(output_layer, GColorBlack);
-    window_set_background_color(config_window, GColorBlack);
-  } else {
-    text_layer_set_text_color(output_layer, GColorBlack);
-    text_layer_set_background_color(output_layer, GColorWhite);
-    window_set_background_color(config_window, GColorWhite);
+  int bucket = 0;
+  while (bucket < STATS_BUCKETS - 1 && elapsed >= s_latency_bounds[bucket]) {
+    bucket++;
   }
+  if (s_stats.latency[id][bucket] < UINT16_MAX) {
+    s_stats.latency[id][bucket]++;
+  }
+}
 
-  switch (nbItem) {
-    case REQUEST_LOCATION:
-      strcpy(text, "LOCATION");
-      break;
-    case REQUEST_FIX_LOCATION:
-      strcpy(text, "FIXING TARGET");
-      break;
-    case REQUEST_START_THREADED_LOCATION:
-      strcpy(text, "START THREAD NAVIGATION");
-      break;
-    case REQUEST_STOP_THREADED_LOCATION:
-      strcpy(text, "STOP THREAD NAVIGATION");
-      break;
-    case REQUEST_ELEVATION:
-      strcpy(text, "ELEVATION");
-      break;
-    case REQUEST_WEATHER_STATUS:
-      strcpy(text, "WEATHER_STATUS");
-      break;
-    case REQUEST_WEATHER_TEMPERATURE:
-      strcpy(text, "TEMPERATURE");
-      break;
-    case REQUEST_WEATHER_PRESSURE:
-      strcpy(text, "PRESSURE");
-      break;
-    case REQUEST_WEATHER_HUMIDITY:
-      strcpy(text, "HUMIDITY");
-      break;
-    case REQUEST_WEATHER_WIND:
-      strcpy(text, "WIND");
-      break;
-    case REQUEST_WEATHER_SUNRISE:
-      strcpy(text, "SUNRISE");
-      break;
-    case REQUEST_WEATHER_SUNSET:
-      strcpy(text, "SUNSET");
-      break;
-    case REQUEST_TRANSPORT:
-      strcpy(text, "TRANSPORT");
-      break;
-    case SHOW_UP_TIME:
-      strcpy(text, "SHOW_UP_TIME");
-      break;
-    case SHOW_ACTIVE_TIME:
-      strcpy(text, "SHOW_ACTIVE_TIME");
-      break;
-    case SHOW_BATTERY_STATE:
-      strcpy(text, "SHOW_BATTERY_STATE");
-      break;
-    default:
-      strcpy(text, "Error.\nPlease check if NUMBER_OF_ITEMS is OK");
-      break;
+static uint32_t stats_count(int id) {
+  uint32_t count = 0;
+  for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+    count += s_stats.latency[id][bucket];
   }
-  text_layer_set_text(output_layer, text);
-  text_layer_set_text_alignment(output_layer, GTextAlignmentCenter);
+  return count;
 }
-void up_main_click_handler(ClickRecognizerRef recognizer, void *context) {
-  if (currentScreen + 1 > 3) {
-    currentScreen = 0;
-  } else {
-    currentScreen = currentScreen + 1;
+
+// Bucket holding the given fraction (in %) of the answers of a request id
+static int stats_percentile(int id, int percent) {
+  uint32_t rank = (stats_count(id) * percent + 99) / 100;
+  uint32_t count = 0;
+  int bucket = 0;
+  for (; bucket < STATS_BUCKETS - 1; bucket++) {
+    count += s_stats.latency[id][bucket];
+    if (count >= rank) {
+      break;
+    }
   }
-  
-   switch(currentScreen) {
-    case 0:
-      strcpy(window_number, "Screen 1");
-    break;
-    case 1:
-      strcpy(window_number, "Screen 2");
-    break;
-    case 2:
-      strcpy(window_number, "Screen 3");
-    break;
-    case 3:
-      strcpy(window_number, "Screen 4");
-    break;
+  return bucket;
+}
+
+static uint32_t unpack_uint32(const uint8_t *data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static void pack_uint32(uint8_t *data, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data[i] = value >> (8 * i);
   }
-  
-  text_layer_set_text(number_layer, window_number);
-  
-  int val = 0;
- switch(currentScreen) {
-    case 0:
-      if (persist_exists(PERSIST_SCREEN1)) {
-        val = persist_read_int(PERSIST_SCREEN1);
-      }
-    break;
-    case 1:
-      if (persist_exists(PERSIST_SCREEN2)) {
-        val = persist_read_int(PERSIST_SCREEN2);
-      }
-    break;
-    case 2:
-      if (persist_exists(PERSIST_SCREEN3)) {
-      val = persist_read_int(PERSIST_SCREEN3);
-      }
-    break;
-    case 3:
-    if (persist_exists(PERSIST_SCREEN4)) {
-      val = persist_read_int(PERSIST_SCREEN4);
+}
+
+// Stats as sent to the phone, all numbers little-endian : uint32 sent,
+// failed, dropped and timeouts, then for each request id with answers its
+// id as one byte and its STATS_BUCKETS counts as uint16. Returns the size.
+static uint16_t stats_dump(uint8_t *data, uint16_t size) {
+  stats_expire(clock_ms());
+  pack_uint32(data, s_stats.sent);
+  pack_uint32(data + 4, s_stats.failed);
+  pack_uint32(data + 8, s_stats.dropped);
+  pack_uint32(data + 12, s_stats.timeouts);
+  uint16_t length = STATS_HEADER_SIZE;
+  for (int id = 0; id < STATS_TYPES && length + 1 + 2 * STATS_BUCKETS <= size; id++) {
+    if (stats_count(id) == 0) {
+      continue;
+    }
+    data[length++] = id;
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+      data[length++] = s_stats.latency[id][bucket];
+      data[length++] = s_stats.latency[id][bucket] >> 8;
     }
-    break;
-  }
-  
-  if (val < 13) {
-    //APP_LOG(APP_LOG_LEVEL_INFO, "Nav send : %d", val);
-	  send(val, "");
   }
-  
+  return length;
 }
 
-void down_main_click_handler(ClickRecognizerRef recognizer, void *context) {
-  if (currentScreen - 1 < 0) {
-    currentScreen = 3;
+AppMessageResult send(int key, char *value) {
+  DictionaryIterator *iter;
+  AppMessageResult result = app_message_outbox_begin(&iter);
+  if (result != APP_MSG_OK) {
+    s_stats.failed++;
+    return result;
+  }
+  if (key == KEY_STATS) {
+    uint8_t dump[OUTBOX_SIZE - 16];
+    dict_write_data(iter, KEY_STATS, dump, stats_dump(dump, sizeof(dump)));
   } else {
-    currentScreen = currentScreen - 1;
+    dict_write_cstring(iter, key, value);
   }
-  
-  switch(currentScreen) {
-    case 0:
-      strcpy(window_number, "Screen 1");
-    break;
-    case 1:
-      strcpy(window_number, "Screen 2");
-    break;
-    case 2:
-      strcpy(window_number, "Screen 3");
-    break;
-    case 3:
-      strcpy(window_number, "Screen 4");
-    break;
+  if (key == REQUEST_TRANSPORT) {
+    dict_write_uint8(iter, KEY_TRANSPORT_COUNT, TIMETABLE_SIZE);
   }
-  
-  text_layer_set_text(number_layer, window_number);
-
-  
-  int val = 0;
-  switch(currentScreen) {
-    case 0:
-      if (persist_exists(PERSIST_SCREEN1)) {
-        val = persist_read_int(PERSIST_SCREEN1);
-      }
-    break;
-    case 1:
-      if (persist_exists(PERSIST_SCREEN2)) {
-        val = persist_read_int(PERSIST_SCREEN2);
-      }
-    break;
-    case 2:
-      if (persist_exists(PERSIST_SCREEN3)) {
-      val = persist_read_int(PERSIST_SCREEN3);
-      }
-    break;
-    case 3:
-    if (persist_exists(PERSIST_SCREEN4)) {
-      val = persist_read_int(PERSIST_SCREEN4);
+  if (key == REQUEST_START_THREADED_LOCATION) {
+    // Knowing the target, only positions are needed and less often
+    dict_write_uint16(iter, KEY_NAV_INTERVAL, s_target_set ? NAV_FIX_INTERVAL_MS : NAV_INTERVAL_MS);
+    if (s_target_set) {
+      dict_write_uint8(iter, KEY_NAV_POSITIONS, 1);
     }
-    break;
   }
-  
-  if (val < 13) {
-   // APP_LOG(APP_LOG_LEVEL_INFO, "Nav send : %d", val);
-	  send(val, "");
+  dict_write_end(iter);
+  trace_dictionary(TRACE_OUTBOX, iter);
+  result = app_message_outbox_send();
+  if (result == APP_MSG_OK) {
+    stats_sent(key);
+  } else {
+    s_stats.failed++;
   }
-  
+  return result;
 }
 
-void click_config_provider(void *context) {
-	window_single_click_subscribe(BUTTON_ID_UP, up_main_click_handler);
-  window_single_click_subscribe(BUTTON_ID_DOWN, down_main_click_handler);
-	window_single_click_subscribe(BUTTON_ID_SELECT, select_click_handler);
+// Outbound requests waiting for the phone. The first entry is the one in
+// flight once s_outbox_in_flight is set, the others are sent in order as
+// each one is acknowledged, prefetches after everything else.
+typedef struct {
+  int request;
+  uint8_t retries;
+  bool prefetch;
+} OutboxEntry;
+
+static OutboxEntry s_outbox[OUTBOX_QUEUE_SIZE];
+static int s_outbox_count = 0;
+static bool s_outbox_in_flight = false;
+static AppTimer *s_outbox_timer = NULL;
+
+static void outbox_remove(int index) {
+  s_outbox_count--;
+  memmove(&s_outbox[index], &s_outbox[index + 1], (s_outbox_count - index) * sizeof(OutboxEntry));
 }
 
-static void main_window_load(Window *window) {
-  Layer *window_layer = window_get_root_layer(window);
-  GRect bounds = layer_get_bounds(window_layer);
+static void outbox_pop(void) {
+  outbox_remove(0);
+}
 
-  switch(currentScreen) {
-    case 0:
-      strcpy(window_number, "Screen 1");
-    break;
-    case 1:
-      strcpy(window_number, "Screen 2");
+static void outbox_retry_later(void);
+
+// Sends the head of the queue unless a message is already on its way
+static void outbox_pump(void) {
+  if (s_outbox_in_flight || s_outbox_timer || s_outbox_count == 0) {
+    return;
+  }
+  AppMessageResult result = send(s_outbox[0].request, "");
+  if (result == APP_MSG_OK) {
+    s_outbox_in_flight = true;
+  } else {
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Outbox send of %d failed : %d", s_outbox[0].request, result);
+    outbox_retry_later();
+  }
+}
+
+static void outbox_timer_callback(void *data) {
+  PROFILE_BEGIN();
+  s_outbox_timer = NULL;
+  outbox_pump();
+  PROFILE_END(PROFILE_TIMER);
+}
+
+// Backs off before sending the head again, and gives up on it after
+// OUTBOX_MAX_RETRIES
+static void outbox_retry_later(void) {
+  if (++s_outbox[0].retries > OUTBOX_MAX_RETRIES) {
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Dropping request %d", s_outbox[0].request);
+    outbox_pop();
+    outbox_pump();
+    return;
+  }
+  s_outbox_timer = app_timer_register(OUTBOX_RETRY_MS << (s_outbox[0].retries - 1),
+                                      outbox_timer_callback, NULL);
+}
+
+// Queues a request for the phone, unless the same one is already pending.
+// A request the user waits for goes ahead of the prefetches.
+static void outbox_queue(int request, bool prefetch) {
+  int first_free = s_outbox_in_flight ? 1 : 0;   // First entry that may move
+
+  for (int i = 0; i < s_outbox_count; i++) {
+    if (s_outbox[i].request != request) {
+      continue;
+    }
+    if (prefetch || !s_outbox[i].prefetch || i < first_free) {
+      s_outbox[i].prefetch &= prefetch;
+      return;
+    }
+    // Now wanted on screen, requeue it with the others
+    outbox_remove(i);
     break;
+  }
+
+  if (s_outbox_count == OUTBOX_QUEUE_SIZE) {
+    if (prefetch) {
+      return;
+    }
+    // Full, forget the last prefetch or else the oldest request not in flight
+    int victim = first_free;
+    for (int i = s_outbox_count - 1; i >= first_free; i--) {
+      if (s_outbox[i].prefetch) {
+        victim = i;
+        break;
+      }
+    }
+    outbox_remove(victim);
+  }
+
+  int position = s_outbox_count;
+  while (!prefetch && position > first_free && s_outbox[position - 1].prefetch) {
+    position--;
+  }
+  memmove(&s_outbox[position + 1], &s_outbox[position], (s_outbox_count - position) * sizeof(OutboxEntry));
+  s_outbox[position] = (OutboxEntry) { .request = request, .retries = 0, .prefetch = prefetch };
+  s_outbox_count++;
+  outbox_pump();
+}
+
+static void outbox_push(int request) {
+  outbox_queue(request, false);
+}
+
+// Takes back a request that was not sent yet, true if there was one
+static bool outbox_cancel(int request) {
+  for (int i = s_outbox_in_flight ? 1 : 0; i < s_outbox_count; i++) {
+    if (s_outbox[i].request == request) {
+      outbox_remove(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+static const RequestInfo *request_get(int id) {
+  if (id < 0 || id >= NUMBER_OF_ITEMS) {
+    return NULL;
+  }
+  return &s_requests[id];
+}
+
+// Bounded writer into a text buffer. It keeps the length so appends do not
+// rescan the buffer, and truncates at the end of the buffer without cutting
+// an UTF-8 character in half. The buffer is always terminated.
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t length;
+} TextBuilder;
+
+static void builder_init(TextBuilder *builder, char *buffer, size_t size) {
+  builder->buffer = buffer;
+  builder->size = size;
+  builder->length = 0;
+  buffer[0] = '\0';
+}
+
+// Appends at most n bytes of value, stopping early at a '\0'
+static void builder_append_n(TextBuilder *builder, const char *value, size_t n) {
+  size_t room = builder->size - 1 - builder->length;
+  const char *end = memchr(value, '\0', n < room + 1 ? n : room + 1);
+  size_t count = end ? (size_t)(end - value) : (n < room + 1 ? n : room + 1);
+  if (count > room) {
+    count = room;
+    // Do not keep the first bytes of a character that does not fit
+    while (count > 0 && ((unsigned char)value[count] & 0xC0) == 0x80) {
+      count--;
+    }
+  }
+  memcpy(builder->buffer + builder->length, value, count);
+  builder->length += count;
+  builder->buffer[builder->length] = '\0';
+}
+
+static void builder_append(TextBuilder *builder, const char *value) {
+  builder_append_n(builder, value, strlen(value));
+}
+
+static void builder_append_int(TextBuilder *builder, int value) {
+  char digits[12];
+  int i = sizeof(digits);
+  unsigned int magnitude = value < 0 ? -(unsigned int)value : (unsigned int)value;
+  do {
+    digits[--i] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) {
+    digits[--i] = '-';
+  }
+  builder_append_n(builder, digits + i, sizeof(digits) - i);
+}
+
+// Appends a template where each %s takes the next value (at most its length
+// in bytes) and %% is a literal %
+static void builder_template(TextBuilder *builder, const char *format,
+                             const char **values, const size_t *lengths, int num_values) {
+  int next = 0;
+  const char *start = format;
+  for (const char *c = strchr(format, '%'); c; c = strchr(c, '%')) {
+    if (c[1] != 's' && c[1] != '%') {
+      c++;
+      continue;
+    }
+    builder_append_n(builder, start, c - start);
+    if (c[1] == '%') {
+      builder_append_n(builder, "%", 1);
+    } else if (next < num_values) {
+      builder_append_n(builder, values[next], lengths[next]);
+      next++;
+    }
+    c += 2;
+    start = c;
+  }
+  builder_append(builder, start);
+}
+
+// How the phone encodes the value of a key when it is not a cstring (older
+// companion apps send every value as text, which is still shown as is)
+typedef enum {
+  VALUE_TEXT,       // cstring
+  VALUE_INT,        // int32
+  VALUE_FIXED1,     // int32, tenths
+  VALUE_FIXED6,     // int32, millionths (degrees of coordinates)
+  VALUE_COMPASS,    // int32, degrees shown as a compass point
+  VALUE_TIME        // uint32, local epoch like time() on the watch, as HH:MM
+} ValueType;
+
+static ValueType value_type(uint32_t key) {
+  switch (key) {
+    case KEY_LATITUDE:
+    case KEY_LONGITUDE:
+      return VALUE_FIXED6;
+    case KEY_TEMPERATURE:
+    case KEY_WIND_SPEED:
+      return VALUE_FIXED1;
+    case KEY_DIRECTION:
+    case KEY_WIND_DIRECTION:
+      return VALUE_COMPASS;
+    case KEY_SUNRISE:
+    case KEY_SUNSET:
+    case KEY_DEPARTURE_TIME:
+    case KEY_ARRIVAL_TIME:
+      return VALUE_TIME;
+    case KEY_DISTANCE:
+    case KEY_ALTITUDE:
+    case KEY_PRESSURE:
+    case KEY_HUMIDITY:
+      return VALUE_INT;
+    default:
+      return VALUE_TEXT;
+  }
+}
+
+// Appends value / 10^decimals with all its decimals
+static void builder_append_fixed(TextBuilder *builder, int32_t value, int decimals) {
+  char digits[16];
+  int i = sizeof(digits);
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+  for (int n = 0; n < decimals; n++) {
+    digits[--i] = '0' + magnitude % 10;
+    magnitude /= 10;
+  }
+  digits[--i] = '.';
+  do {
+    digits[--i] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) {
+    digits[--i] = '-';
+  }
+  builder_append_n(builder, digits + i, sizeof(digits) - i);
+}
+
+// Formats a number sent by the phone for key
+static void value_append_int(TextBuilder *builder, uint32_t key, int32_t value) {
+  static const char *compass[] = { "N", "NE", "E", "SE", "S", "SW", "W", "NW" };
+  switch (value_type(key)) {
+    case VALUE_FIXED1:
+      builder_append_fixed(builder, value, 1);
+      break;
+    case VALUE_FIXED6:
+      builder_append_fixed(builder, value, 6);
+      break;
+    case VALUE_COMPASS:
+      builder_append(builder, compass[((value % 360 + 360) % 360 * 2 + 45) / 90 % 8]);
+      break;
+    case VALUE_TIME: {
+      uint32_t minutes = (uint32_t)value % 86400 / 60;
+      char clock[5] = { '0' + minutes / 600, '0' + minutes / 60 % 10, ':',
+                        '0' + minutes % 60 / 10, '0' + minutes % 10 };
+      builder_append_n(builder, clock, sizeof(clock));
+      break;
+    }
+    default:
+      builder_append_int(builder, value);
+  }
+}
+
+// A phone may leave keys out or send them as text, so numbers are read
+// only from tuples that hold one
+static bool tuple_is_int(const Tuple *tuple) {
+  return tuple && (tuple->type == TUPLE_INT || tuple->type == TUPLE_UINT) &&
+         (tuple->length == 1 || tuple->length == 2 || tuple->length == 4);
+}
+
+static int32_t tuple_int(const Tuple *tuple) {
+  bool is_signed = tuple->type == TUPLE_INT;
+  switch (tuple->length) {
+    case 1:
+      return is_signed ? tuple->value->int8 : tuple->value->uint8;
     case 2:
-      strcpy(window_number, "Screen 3");
-    break;
-    case 3:
-      strcpy(window_number, "Screen 4");
-    break;
+      return is_signed ? tuple->value->int16 : tuple->value->uint16;
+    case 4:
+      return tuple->value->int32;
+    default:
+      return 0;
+  }
+}
+
+// Appends the value of a tuple, text or number, read no further than the
+// tuple itself. Byte arrays are bundles, unpacked by their own reader.
+static void value_append(TextBuilder *builder, const Tuple *tuple) {
+  if (tuple->type == TUPLE_CSTRING) {
+    builder_append_n(builder, tuple->value->cstring, tuple->length);
+  } else if (tuple->type == TUPLE_INT || tuple->type == TUPLE_UINT) {
+    value_append_int(builder, tuple->key, tuple_int(tuple));
+  }
+}
+
+// Last weather fields received, indexed by key - KEY_STATUS
+static char s_weather[NUM_WEATHER_FIELDS][WEATHER_FIELD_SIZE];
+static time_t s_weather_time = 0;   // Of the last REQUEST_WEATHER_ALL answer
+
+static bool is_weather_key(uint32_t key) {
+  return key >= KEY_STATUS && key <= KEY_SUNSET;
+}
+
+// Last position of the phone, from any answer with one : the location, the
+// target or navigation
+static GeoPoint s_position;
+static bool s_position_known = false;
+
+static void position_store(DictionaryIterator *iter) {
+  Tuple *lat = dict_find(iter, KEY_LATITUDE);
+  Tuple *lon = dict_find(iter, KEY_LONGITUDE);
+  if (tuple_is_int(lat) && tuple_is_int(lon)) {
+    s_position = (GeoPoint){ tuple_int(lat), tuple_int(lon) };
+    s_position_known = true;
+  }
+}
+
+// Sunrise and sunset are worked out on the watch once a day from the last
+// position known (sun.h), so their screens need no phone. time() being
+// local on the watch, the offset to UTC is learnt from the sunrise of every
+// weather answer. Until both are known they come with the weather.
+#define SUN_MOVE            100000  // Millionths of a degree moved before working them out again
+
+typedef struct {
+  GeoPoint position;
+  int32_t utc_offset;               // s, local time - UTC
+  bool located;
+  bool offset_known;
+} SunPlace;
+
+static SunPlace s_sun;
+static uint32_t s_sun_day = 0;      // Local day of the fields, 0 to work them out again
+static time_t s_sun_learnt = 0;     // Sunrise of the phone the offset was learnt from
+
+static void sun_locate(void) {
+  if (!s_position_known || (s_sun.located && abs(s_position.lat - s_sun.position.lat) < SUN_MOVE &&
+                            abs(s_position.lon - s_sun.position.lon) < SUN_MOVE)) {
+    return;
+  }
+  s_sun.position = s_position;
+  s_sun.located = true;
+  s_sun_day = 0;
+  s_sun_learnt = 0;
+  persist_write_data(PERSIST_SUN, &s_sun, sizeof(s_sun));
+}
+
+// Offset of a sunrise of the phone, in local time, to the one worked out in
+// UTC, in quarters of an hour
+static void sun_learn(time_t local_rise) {
+  time_t rise, set;
+  if (local_rise == s_sun_learnt || !s_sun.located ||
+      !sun_times(&s_sun.position, local_rise / 86400, &rise, &set)) {
+    return;
+  }
+  s_sun_learnt = local_rise;
+  int32_t offset = local_rise - rise;
+  offset = (offset + (offset < 0 ? -450 : 450)) / 900 * 900;
+  if (!s_sun.offset_known || offset != s_sun.utc_offset) {
+    s_sun.utc_offset = offset;
+    s_sun.offset_known = true;
+    s_sun_day = 0;
+    persist_write_data(PERSIST_SUN, &s_sun, sizeof(s_sun));
+  }
+}
+
+// Puts today's sunrise and sunset in the weather fields, false until they
+// can be worked out
+static bool sun_update(void) {
+  if (!s_sun.located || !s_sun.offset_known) {
+    return false;
+  }
+  uint32_t day = time(NULL) / 86400;
+  if (day == s_sun_day) {
+    return true;
+  }
+  time_t rise, set;
+  bool crosses = sun_times(&s_sun.position, day, &rise, &set);
+  TextBuilder field;
+  builder_init(&field, s_weather[KEY_SUNRISE - KEY_STATUS], WEATHER_FIELD_SIZE);
+  if (crosses) {
+    value_append_int(&field, KEY_SUNRISE, rise + s_sun.utc_offset);
+  } else {
+    builder_append(&field, "--:--");
+  }
+  builder_init(&field, s_weather[KEY_SUNSET - KEY_STATUS], WEATHER_FIELD_SIZE);
+  if (crosses) {
+    value_append_int(&field, KEY_SUNSET, set + s_sun.utc_offset);
+  } else {
+    builder_append(&field, "--:--");
+  }
+  s_sun_day = day;
+  return true;
+}
+
+// Next connections of the transport answer. The screen counts down to the
+// next departure every second and moves on to the following one by itself,
+// the phone being asked again only when TIMETABLE_LOW connections are left
+// or the wearer moved away from where it answered.
+typedef struct {
+  char departure[TIMETABLE_NAME_SIZE];
+  char arrival[TIMETABLE_NAME_SIZE];
+  time_t base;                          // Departure of the first connection
+  uint16_t departs[TIMETABLE_SIZE];     // s after base
+  uint16_t takes[TIMETABLE_SIZE];       // s from departure to arrival
+  uint8_t count;
+  uint8_t next;                         // First connection not gone
+  time_t time;                          // Of the answer
+  time_t asked;                         // Last refresh asked from the screen
+  GeoPoint origin;                      // Position of the phone when it answered
+  bool located;
+} Timetable;
+
+static Timetable s_timetable;
+
+// Connections are kept in order, in 16 bits from the first one
+static bool timetable_add(time_t departure, time_t arrival) {
+  if (s_timetable.count == 0) {
+    s_timetable.base = departure;
+  }
+  if (s_timetable.count == TIMETABLE_SIZE || departure < s_timetable.base ||
+      departure - s_timetable.base > UINT16_MAX || arrival < departure || arrival - departure > UINT16_MAX) {
+    return false;
+  }
+  s_timetable.departs[s_timetable.count] = departure - s_timetable.base;
+  s_timetable.takes[s_timetable.count] = arrival - departure;
+  s_timetable.count++;
+  return true;
+}
+
+// A whole timetable, or the one connection of an older companion app
+static void timetable_store(DictionaryIterator *iter) {
+  Tuple *table = dict_find(iter, KEY_TIMETABLE);
+  Tuple *departure = dict_find(iter, KEY_DEPARTURE_TIME);
+  Tuple *arrival = dict_find(iter, KEY_ARRIVAL_TIME);
+  Tuple *from = dict_find(iter, KEY_DEPARTURE);
+  Tuple *to = dict_find(iter, KEY_ARRIVAL);
+  TextBuilder name;
+
+  s_timetable.count = 0;
+  s_timetable.next = 0;
+  if (table && table->type == TUPLE_BYTE_ARRAY) {
+    for (int i = 0; (i + 1) * 8 <= table->length; i++) {
+      const uint8_t *data = table->value->data + i * 8;
+      if (!timetable_add(unpack_uint32(data), unpack_uint32(data + 4))) {
+        break;
+      }
+    }
+  } else if (tuple_is_int(departure) && tuple_is_int(arrival)) {
+    timetable_add((uint32_t)tuple_int(departure), (uint32_t)tuple_int(arrival));
+  }
+  builder_init(&name, s_timetable.departure, TIMETABLE_NAME_SIZE);
+  if (from) {
+    value_append(&name, from);
+  }
+  builder_init(&name, s_timetable.arrival, TIMETABLE_NAME_SIZE);
+  if (to) {
+    value_append(&name, to);
+  }
+  s_timetable.time = time(NULL);
+  s_timetable.origin = s_position;
+  s_timetable.located = s_position_known;
+}
+
+// Connections not gone at now, moving past the ones that are
+static int timetable_ahead(time_t now) {
+  while (s_timetable.next < s_timetable.count &&
+         s_timetable.base + s_timetable.departs[s_timetable.next] <= now) {
+    s_timetable.next++;
+  }
+  return s_timetable.count - s_timetable.next;
+}
+
+// Now while the timetable holds enough connections from where the wearer
+// is, else the time of the answer so that it is asked again after its ttl
+static time_t timetable_answer_time(void) {
+  time_t now = time(NULL);
+  int32_t distance = 0;
+  int16_t bearing;
+  if (s_timetable.located && s_position_known) {
+    geo_distance_bearing(&s_timetable.origin, &s_position, &distance, &bearing);
+  }
+  if (timetable_ahead(now) <= TIMETABLE_LOW || distance > TIMETABLE_MOVE_M) {
+    return s_timetable.time;
+  }
+  return now;
+}
+
+// Keeps the weather fields of an answer, whichever request it is for
+static void weather_store(DictionaryIterator *iter) {
+  TextBuilder field;
+  for (Tuple *tuple = dict_read_first(iter); tuple; tuple = dict_read_next(iter)) {
+    if (tuple->key == KEY_WEATHER_DATA && tuple->type == TUPLE_BYTE_ARRAY) {
+      // Numeric fields packed in key order, as many as were sent
+      for (int i = 0; (i + 1) * 4 <= tuple->length && KEY_TEMPERATURE + i <= KEY_SUNSET; i++) {
+        const uint8_t *data = tuple->value->data + i * 4;
+        int32_t value = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+        if (KEY_TEMPERATURE + i == KEY_SUNRISE) {
+          sun_learn((uint32_t)value);
+        }
+        builder_init(&field, s_weather[KEY_TEMPERATURE + i - KEY_STATUS], WEATHER_FIELD_SIZE);
+        value_append_int(&field, KEY_TEMPERATURE + i, value);
+      }
+    } else if (is_weather_key(tuple->key) && tuple->type != TUPLE_BYTE_ARRAY && tuple->length > 0) {
+      if (tuple->key == KEY_SUNRISE && tuple_is_int(tuple)) {
+        sun_learn((uint32_t)tuple_int(tuple));
+      }
+      builder_init(&field, s_weather[tuple->key - KEY_STATUS], WEATHER_FIELD_SIZE);
+      value_append(&field, tuple);
+    }
+  }
+}
+
+// Item assigned to a screen, or fallback when none was chosen yet
+static int screen_get_request(int screen, int fallback) {
+  return s_config.screens[screen] != -1 ? s_config.screens[screen] : fallback;
+}
+
+// First screen showing the item, which keeps its answer. A screen with no
+// item chosen shows item 0, as main_show_screen does.
+static Screen *screen_of_item(int id) {
+  for (int i = 0; i < s_config.num_screens; i++) {
+    if (screen_get_request(i, 0) == id) {
+      return &s_screen_pool[i];
+    }
+  }
+  return NULL;
+}
+
+static Screen *cache_find(int id) {
+  Screen *screen = screen_of_item(id);
+  return screen && screen->time != 0 ? screen : NULL;
+}
+
+// Time of the answer the item would be displayed from, 0 if none yet
+static time_t request_answer_time(int id, const RequestInfo *request) {
+  if (id == REQUEST_TRANSPORT && s_timetable.count > 0 && cache_find(id)) {
+    return timetable_answer_time();
+  }
+  // Worked out on the watch, never stale
+  if ((id == REQUEST_WEATHER_SUNRISE || id == REQUEST_WEATHER_SUNSET) && sun_update()) {
+    return time(NULL);
+  }
+  if (request->source == SOURCE_WEATHER) {
+    return s_weather_time;
+  }
+  Screen *entry = cache_find(id);
+  return entry ? entry->time : 0;
+}
+
+// Builds the display of an item from the answer in iter, weather fields come
+// from the store. Missing keys are shown empty rather than crashing the app,
+// and phone strings are read no further than their tuple. Text is used in
+// place, numbers are formatted into numbers[] first.
+static void request_format(const RequestInfo *request, DictionaryIterator *iter, char *buffer) {
+  const char *values[MAX_RESPONSE_KEYS] = { "", "", "", "" };
+  size_t lengths[MAX_RESPONSE_KEYS] = { 0 };
+  char numbers[MAX_RESPONSE_KEYS][WEATHER_FIELD_SIZE];
+  for (int i = 0; i < request->num_keys; i++) {
+    if (request->source == SOURCE_WEATHER) {
+      values[i] = s_weather[request->keys[i] - KEY_STATUS];
+      lengths[i] = WEATHER_FIELD_SIZE;
+    } else if (iter) {
+      Tuple *tuple = dict_find(iter, request->keys[i]);
+      if (!tuple || tuple->length == 0) {
+        continue;
+      }
+      if (tuple->type == TUPLE_CSTRING) {
+        values[i] = tuple->value->cstring;
+        lengths[i] = tuple->length;
+      } else if (tuple->type == TUPLE_INT || tuple->type == TUPLE_UINT) {
+        TextBuilder number;
+        builder_init(&number, numbers[i], WEATHER_FIELD_SIZE);
+        value_append(&number, tuple);
+        values[i] = numbers[i];
+        lengths[i] = number.length;
+      }
+    }
+  }
+  TextBuilder builder;
+  builder_init(&builder, buffer, MAX_TEXT_SIZE);
+  builder_template(&builder, request->format, values, lengths, request->num_keys);
+}
+
+static bool timetable_show(void);
+
+// Displays the last known answer of an item
+static void request_show(int id, const RequestInfo *request) {
+  if (request->source == SOURCE_WEATHER) {
+    request_format(request, NULL, text);
+    output_set_text(text);
+  } else if (id != REQUEST_TRANSPORT || !timetable_show()) {
+    Screen *entry = cache_find(id);
+    if (entry) {
+      output_set_text(entry->text);
+    }
+  }
+}
+
+// Shows the item right away from the cache, and asks the phone again only
+// when there is no answer yet or it is older than the item's ttl. Local
+// items are left to their service.
+static void request_send(int id) {
+  const RequestInfo *request = request_get(id);
+  if (!request || request->source == SOURCE_WATCH) {
+    return;
+  }
+  time_t answered = request->format ? request_answer_time(id, request) : 0;
+  if (answered) {
+    request_show(id, request);
+  } else if (request->format) {
+    strcpy(text, "Loading...");
+    output_set_text(text);
+  }
+  if (!answered || time(NULL) - answered >= s_config.ttl[id]) {
+    //APP_LOG(APP_LOG_LEVEL_INFO, "Nav send : %d", id);
+    outbox_push(request->source == SOURCE_WEATHER ? REQUEST_WEATHER_ALL : id);
+  }
+}
+
+static void screen_set_request(int screen, int id) {
+  if (s_config.screens[screen] != id) {
+    s_config.screens[screen] = id;
+    s_screen_pool[screen].time = 0;
+    s_config_dirty = true;
+  }
+}
+
+// Adds empty screens or forgets the last ones, between 1 and MAX_SCREENS
+static void screens_resize(int num_screens) {
+  if (num_screens < 1 || num_screens > MAX_SCREENS) {
+    return;
+  }
+  for (int i = num_screens; i < MAX_SCREENS; i++) {
+    screen_set_request(i, -1);
+  }
+  s_config.num_screens = num_screens;
+  s_config_dirty = true;
+  if (currentScreen >= num_screens) {
+    currentScreen = num_screens - 1;
+  }
+}
+
+static void config_save(void) {
+  if (s_config_dirty) {
+    persist_write_data(PERSIST_CONFIG, &s_config, sizeof(s_config));
+    s_config_dirty = false;
+  }
+}
+
+// Screens of a version without PERSIST_CONFIG, moved into the blob
+static void config_migrate_screens(void) {
+  for (int i = 0; i < NUMBER_OF_SCREENS; i++) {
+    if (persist_exists(PERSIST_SCREEN1 + i)) {
+      s_config.screens[i] = persist_read_int(PERSIST_SCREEN1 + i);
+      s_config_dirty = true;
+    }
+  }
+  if (s_config_dirty) {
+    config_save();
+    for (int i = 0; i < NUMBER_OF_SCREENS; i++) {
+      persist_delete(PERSIST_SCREEN1 + i);
+    }
+  }
+}
+
+static void config_load(void) {
+  s_config.version = CONFIG_VERSION;
+  s_config.num_screens = NUMBER_OF_SCREENS;
+  memset(s_config.screens, -1, sizeof(s_config.screens));
+  s_config.still_rate = ACCEL_SAMPLING_10HZ;
+  s_config.moving_rate = ACCEL_SAMPLING_25HZ;
+  for (int i = 0; i < NUMBER_OF_ITEMS; i++) {
+    s_config.ttl[i] = s_requests[i].ttl;
+  }
+
+  union {
+    Config config;
+    ConfigV1 v1;
+  } stored;
+  // A blob is only taken whole, with the size of the layout its version
+  // claims. Any other one, as from a newer version, leaves the defaults.
+  int size = persist_read_data(PERSIST_CONFIG, &stored, sizeof(stored));
+  if (size == sizeof(ConfigV1) && stored.v1.version == 1) {
+    memcpy(s_config.screens, stored.v1.screens, sizeof(stored.v1.screens));
+    s_config.still_rate = stored.v1.still_rate;
+    s_config.moving_rate = stored.v1.moving_rate;
+    memcpy(s_config.ttl, stored.v1.ttl, sizeof(stored.v1.ttl));
+    s_config_dirty = true;
+  } else if (size == sizeof(Config) && stored.config.version == CONFIG_VERSION) {
+    s_config = stored.config;
+  } else {
+    config_migrate_screens();
+  }
+  if (s_config.num_screens < 1 || s_config.num_screens > MAX_SCREENS) {
+    s_config.num_screens = NUMBER_OF_SCREENS;
+  }
+}
+
+// Asks in the background for the items of the screens next to the current
+// one, which are the ones up/down will show, when their answer is missing or
+// stale. Skipped while the outbox has other work or the battery is low.
+static void prefetch_neighbours(void) {
+  BatteryChargeState battery = battery_state_service_peek();
+  if (s_outbox_count > 0 ||
+      (battery.charge_percent < PREFETCH_MIN_BATTERY && !battery.is_charging)) {
+    return;
+  }
+  int neighbours[] = {
+    (currentScreen + 1) % s_config.num_screens,
+    (currentScreen + s_config.num_screens - 1) % s_config.num_screens
+  };
+  for (int i = 0; i < 2; i++) {
+    int id = screen_get_request(neighbours[i], 0);
+    const RequestInfo *request = request_get(id);
+    if (!request || request->source == SOURCE_WATCH || !request->format || s_config.ttl[id] == 0) {
+      continue;
+    }
+    time_t answered = request_answer_time(id, request);
+    if (!answered || time(NULL) - answered >= s_config.ttl[id]) {
+      outbox_queue(request->source == SOURCE_WEATHER ? REQUEST_WEATHER_ALL : id, true);
+    }
+  }
+}
+
+// Appends a duration in s as "<label>:\n<h>h <m>m <s>s"
+static void builder_append_duration(TextBuilder *builder, const char *label, unsigned long int duration) {
+  builder_append(builder, label);
+  builder_append(builder, ":\n");
+  builder_append_int(builder, duration / 3600);
+  builder_append(builder, "h ");
+  builder_append_int(builder, (duration % 3600) / 60);
+  builder_append(builder, "m ");
+  builder_append_int(builder, duration % 60);
+  builder_append(builder, "s");
+}
+
+// Appends minutes as "<h>h <m>m", or "<m>m" under an hour
+static void builder_append_minutes(TextBuilder *builder, unsigned int minutes) {
+  if (minutes >= 60) {
+    builder_append_int(builder, minutes / 60);
+    builder_append(builder, "h ");
+  }
+  builder_append_int(builder, minutes % 60);
+  builder_append(builder, "m");
+}
+
+static void show_duration(const char *label, unsigned long int duration) {
+  TextBuilder builder;
+  builder_init(&builder, text, MAX_TEXT_SIZE);
+  builder_append_duration(&builder, label, duration);
+  output_set_text(text);
+}
+
+static void show_up_time(void) {
+  // Get time since launch
+  show_duration("Uptime", time(NULL) - launch_time);
+}
+
+// Total of the worker, then the days of its history
+static void show_active_time(void) {
+  TextBuilder builder;
+  builder_init(&builder, text, MAX_TEXT_SIZE);
+  builder_append_duration(&builder, "Active time", active_time);
+  builder_append(&builder, "\ntoday ");
+  builder_append_minutes(&builder, s_activity.today);
+  builder_append(&builder, "\nyesterday ");
+  builder_append_minutes(&builder, s_activity.yesterday);
+  builder_append(&builder, "\n7 days ");
+  builder_append_minutes(&builder, s_activity.week);
+  output_set_text(text);
+}
+
+static void show_battery_state(BatteryChargeState charge_state) {
+  TextBuilder builder;
+  builder_init(&builder, text, MAX_TEXT_SIZE);
+  if (charge_state.is_charging) {
+    builder_append(&builder, "Battery is charging");
+  }
+  else {
+    builder_append(&builder, "Battery is\n");
+    builder_append_int(&builder, charge_state.charge_percent);
+    builder_append(&builder, "% charged");
+  }
+  output_set_text(text);
+}
+
+// Next connection and the time left before it departs, false without a
+// timetable
+static bool timetable_show(void) {
+  time_t now = time(NULL);
+  if (s_timetable.count == 0) {
+    return false;
+  }
+  TextBuilder builder;
+  builder_init(&builder, text, MAX_TEXT_SIZE);
+  int ahead = timetable_ahead(now);
+  if (ahead == 0) {
+    builder_append(&builder, "No more connections");
+  } else {
+    time_t departure = s_timetable.base + s_timetable.departs[s_timetable.next];
+    builder_append(&builder, s_timetable.departure);
+    builder_append(&builder, " : ");
+    value_append_int(&builder, KEY_DEPARTURE_TIME, departure);
+    builder_append(&builder, "\n");
+    builder_append(&builder, s_timetable.arrival);
+    builder_append(&builder, " : ");
+    value_append_int(&builder, KEY_ARRIVAL_TIME, departure + s_timetable.takes[s_timetable.next]);
+    builder_append(&builder, "\nin ");
+    builder_append_minutes(&builder, (departure - now) / 60);
+    if (departure - now < 3600) {
+      builder_append(&builder, " ");
+      builder_append_int(&builder, (departure - now) % 60);
+      builder_append(&builder, "s");
+    }
+    if (ahead > 1) {
+      builder_append(&builder, " (+");
+      builder_append_int(&builder, ahead - 1);
+      builder_append(&builder, ")");
+    }
+  }
+  output_set_text(text);
+  return true;
+}
+
+// Asks the next connections from the screen once the timetable runs low,
+// no more than once per ttl
+static void timetable_refresh(void) {
+  time_t now = time(NULL);
+  time_t ttl = s_config.ttl[REQUEST_TRANSPORT];
+  time_t answered = timetable_answer_time();
+  if (answered != now && now - answered >= ttl && now - s_timetable.asked >= ttl) {
+    s_timetable.asked = now;
+    outbox_push(REQUEST_TRANSPORT);
+  }
+}
+
+// Items of the tick service, redrawn every second
+static void tick_show(void) {
+  if (screen_get_request(currentScreen, 0) != REQUEST_TRANSPORT) {
+    show_up_time();
+  } else if (timetable_show()) {
+    timetable_refresh();
+  }
+}
+
+void tick_handler(struct tm *tick_time, TimeUnits units_changed) {
+  PROFILE_BEGIN();
+  tick_show();
+  PROFILE_END(PROFILE_TICK);
+}
+
+static void battery_handler(BatteryChargeState charge_state) {
+  PROFILE_BEGIN();
+  show_battery_state(charge_state);
+  PROFILE_END(PROFILE_BATTERY);
+}
+
+ 
+// One row per screen, then the add and remove rows and the diagnostics
+uint16_t num_rows_callback(MenuLayer *menu_layer, uint16_t section_index, void *callback_context)
+{
+  return s_config.num_screens + (s_config.num_screens < MAX_SCREENS) + (s_config.num_screens > 1) + 1;
+}
+
+static void draw_row_handler(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, 
+                             void *callback_context) {
+  int row = cell_index->row;
+  if (row < s_config.num_screens) {
+    snprintf(s_screen_text, sizeof(s_screen_text), "SCREEN %d", row + 1);
+  } else if (row == s_config.num_screens && s_config.num_screens < MAX_SCREENS) {
+    strcpy(s_screen_text, "ADD SCREEN");
+  } else if (row == num_rows_callback(NULL, 0, NULL) - 1) {
+    strcpy(s_screen_text, "DIAGNOSTICS");
+  } else {
+    strcpy(s_screen_text, "REMOVE SCREEN");
+  }
+
+  menu_cell_basic_draw(ctx, cell_layer, s_screen_text, NULL, NULL);
+}
+
+static int16_t get_cell_height_callback(MenuLayer *menu_layer, MenuIndex *cell_index, 
+                                        void *callback_context) {
+  return 60;
+}
+
+static void menu_window_create(void) {
+  s_menu_window = window_create();
+  Layer *window_layer = window_get_root_layer(s_menu_window);
+  GRect bounds = layer_get_bounds(window_layer);
+
+  s_menu_layer = menu_layer_create(bounds);
+  menu_layer_set_callbacks(s_menu_layer, NULL, (MenuLayerCallbacks){
+    .get_num_rows = num_rows_callback,
+    .get_cell_height = get_cell_height_callback,
+    .draw_row = draw_row_handler,
+    .select_click = select_callback,
+    .selection_changed = selection_changed_callback
+  }); 
+  menu_layer_set_click_config_onto_window(s_menu_layer,	s_menu_window);
+  layer_add_child(window_layer, menu_layer_get_layer(s_menu_layer));
+}
+
+static void menu_window_destroy(void) {
+  menu_layer_destroy(s_menu_layer);
+  window_destroy(s_menu_window);
+}
+
+
+// Watch services, each one subscribed only while the visible screen shows the
+// item it feeds
+static void tick_service_start(void) {
+  tick_timer_service_subscribe(SECOND_UNIT, tick_handler);
+  tick_show();
+}
+
+static bool s_worker_starting = false;  // Launched, has not sent its totals yet
+
+static void worker_send(WorkerMessageType type, uint16_t data0, uint16_t data1) {
+  AppWorkerMessage message = { .data0 = data0, .data1 = data1 };
+  app_worker_send_message(type, &message);
+}
+
+// The worker samples the accelerometer whether the app runs or not, the app
+// only hears of the totals, and only while they are on screen
+static void activity_service_start(void) {
+  worker_send(WORKER_WATCH, 0, 0);
+  show_active_time();
+}
+
+static void activity_service_stop(void) {
+  worker_send(WORKER_UNWATCH, 0, 0);
+}
+
+static void battery_service_start(void) {
+  battery_state_service_subscribe(battery_handler);
+  show_battery_state(battery_state_service_peek());
+}
+
+// Navigation streamed by the phone while its screen is shown.
+//
+// With the target on the watch, frames are the positions of the phone and
+// distance and bearing are computed here. Between two fixes the position
+// is moved on at the speed between the last two, so the screen follows the
+// wearer every NAV_RENDER_MS on a few fixes.
+//
+// Otherwise every frame carries a sequence number and the change of
+// distance and bearing since the previous one, keyframes also carry the
+// absolute values. A gap in the sequence drops the state until the next
+// keyframe, asked for right away.
+static struct {
+  int32_t distance;     // m
+  int16_t bearing;      // degrees
+  uint8_t seq;          // Of the last frame applied
+  bool valid;           // A keyframe was received since the stream started
+  uint8_t fixes;        // Positions received since the stream started, up to 2
+  GeoPoint fix[2];      // Last two positions, the latest last
+  uint32_t fix_ms[2];
+} s_nav;
+
+static char s_nav_text[MAX_TEXT_SIZE];
+static AppTimer *s_nav_timer = NULL;
+static uint32_t s_nav_render_ms = 0;
+
+static void nav_render(void) {
+  const RequestInfo *request = request_get(REQUEST_START_THREADED_LOCATION);
+  char numbers[2][WEATHER_FIELD_SIZE];
+  const char *values[] = { numbers[0], numbers[1] };
+  size_t lengths[2];
+  TextBuilder builder;
+
+  builder_init(&builder, numbers[0], WEATHER_FIELD_SIZE);
+  value_append_int(&builder, KEY_DISTANCE, s_nav.distance);
+  lengths[0] = builder.length;
+  builder_init(&builder, numbers[1], WEATHER_FIELD_SIZE);
+  value_append_int(&builder, KEY_DIRECTION, s_nav.bearing);
+  lengths[1] = builder.length;
+  builder_init(&builder, s_nav_text, MAX_TEXT_SIZE);
+  builder_template(&builder, request->format, values, lengths, 2);
+
+  output_set_text(s_nav_text);
+  s_nav_render_ms = clock_ms();
+}
+
+static int32_t nav_wrap_lon(int32_t lon) {
+  if (lon > 180000000) {
+    return lon - 360000000;
+  }
+  return lon < -180000000 ? lon + 360000000 : lon;
+}
+
+// Where the wearer should be now, moved on from the last fix for at most
+// NAV_EXTRAPOLATE_MS. Returns false once the position stopped moving.
+static bool nav_dead_reckon(GeoPoint *position, uint32_t now) {
+  *position = s_nav.fix[1];
+  if (s_nav.fixes < 2) {
+    return false;
+  }
+  uint32_t period = s_nav.fix_ms[1] - s_nav.fix_ms[0];
+  uint32_t elapsed = now - s_nav.fix_ms[1];
+  if (period == 0 || period > NAV_EXTRAPOLATE_MS) {
+    return false;
+  }
+  if (elapsed > NAV_EXTRAPOLATE_MS) {
+    elapsed = NAV_EXTRAPOLATE_MS;
+  }
+  int32_t lat = position->lat + (int64_t)(s_nav.fix[1].lat - s_nav.fix[0].lat) * elapsed / period;
+  int32_t d_lon = nav_wrap_lon(s_nav.fix[1].lon - s_nav.fix[0].lon);
+  position->lat = lat > 90000000 ? 90000000 : lat < -90000000 ? -90000000 : lat;
+  position->lon = nav_wrap_lon(position->lon + (int64_t)d_lon * elapsed / period);
+  return elapsed < NAV_EXTRAPOLATE_MS;
+}
+
+static void nav_timer_callback(void *data);
+
+// Distance and bearing to the target from the position now, redrawn every
+// NAV_RENDER_MS while it moves
+static void nav_locate(void) {
+  GeoPoint position;
+  bool moving = nav_dead_reckon(&position, clock_ms());
+  geo_distance_bearing(&position, &s_target, &s_nav.distance, &s_nav.bearing);
+  s_nav.valid = true;
+  nav_render();
+  if (moving && !s_nav_timer) {
+    s_nav_timer = app_timer_register(NAV_RENDER_MS, nav_timer_callback, NULL);
+  }
+}
+
+static void nav_timer_callback(void *data) {
+  PROFILE_BEGIN();
+  s_nav_timer = NULL;
+  if (s_nav.fixes > 0) {
+    nav_locate();
+  } else {
+    nav_render();
+  }
+  PROFILE_END(PROFILE_TIMER);
+}
+
+// A position of the phone. While the screen is redrawn on a timer the next
+// redraw takes it.
+static void nav_fix(int32_t lat, int32_t lon) {
+  s_nav.fix[0] = s_nav.fix[1];
+  s_nav.fix_ms[0] = s_nav.fix_ms[1];
+  s_nav.fix[1] = (GeoPoint){ lat, lon };
+  s_nav.fix_ms[1] = clock_ms();
+  if (s_nav.fixes < 2) {
+    s_nav.fixes++;
+  }
+  if (!s_nav_timer) {
+    nav_locate();
+  }
+}
+
+// The phone answers REQUEST_FIX_LOCATION with the position it fixed. An
+// older one answers nothing and keeps the target to itself.
+static void nav_target_store(DictionaryIterator *iter) {
+  Tuple *lat = dict_find(iter, KEY_LATITUDE);
+  Tuple *lon = dict_find(iter, KEY_LONGITUDE);
+  if (!tuple_is_int(lat) || !tuple_is_int(lon)) {
+    return;
+  }
+  s_target = (GeoPoint){ tuple_int(lat), tuple_int(lon) };
+  s_target_set = true;
+  persist_write_data(PERSIST_TARGET, &s_target, sizeof(s_target));
+}
+
+// Redraws now, or once NAV_RENDER_MS have passed since the last redraw.
+// Frames arriving in between only update the state.
+static void nav_schedule_render(void) {
+  uint32_t elapsed = clock_ms() - s_nav_render_ms;
+  if (s_nav_timer) {
+    return;
+  }
+  if (elapsed >= NAV_RENDER_MS) {
+    nav_render();
+  } else {
+    s_nav_timer = app_timer_register(NAV_RENDER_MS - elapsed, nav_timer_callback, NULL);
+  }
+}
+
+static void nav_frame(DictionaryIterator *iter) {
+  Tuple *lat = dict_find(iter, KEY_LATITUDE);
+  Tuple *lon = dict_find(iter, KEY_LONGITUDE);
+  Tuple *delta = dict_find(iter, KEY_NAV_DELTA);
+  Tuple *distance = dict_find(iter, KEY_DISTANCE);
+  Tuple *bearing = dict_find(iter, KEY_DIRECTION);
+
+  if (s_target_set && tuple_is_int(lat) && tuple_is_int(lon)) {
+    nav_fix(tuple_int(lat), tuple_int(lon));
+    return;
+  }
+  if (!delta || delta->type != TUPLE_BYTE_ARRAY || delta->length < 4) {
+    // Companion app without streaming, shown as it comes
+    request_format(request_get(REQUEST_START_THREADED_LOCATION), iter, s_nav_text);
+    output_set_text(s_nav_text);
+    return;
+  }
+  const uint8_t *data = delta->value->data;
+  if (tuple_is_int(distance) && tuple_is_int(bearing)) {
+    s_nav.distance = tuple_int(distance);
+    s_nav.bearing = tuple_int(bearing);
+    s_nav.valid = true;
+  } else if (s_nav.valid && data[0] == (uint8_t)(s_nav.seq + 1)) {
+    s_nav.distance += (int16_t)(data[1] | data[2] << 8);
+    s_nav.bearing = ((s_nav.bearing + (int8_t)data[3]) % 360 + 360) % 360;
+  } else {
+    // Lost a frame, the phone restarts the stream with a keyframe
+    if (s_nav.valid) {
+      s_nav.valid = false;
+      outbox_push(REQUEST_START_THREADED_LOCATION);
+    }
+    return;
+  }
+  s_nav.seq = data[0];
+  nav_schedule_render();
+}
+
+static void nav_service_start(void) {
+  s_nav.valid = false;
+  s_nav.fixes = 0;
+  outbox_cancel(REQUEST_STOP_THREADED_LOCATION);
+  outbox_push(REQUEST_START_THREADED_LOCATION);
+  strcpy(text, "Loading...");
+  output_set_text(text);
+}
+
+static void nav_service_stop(void) {
+  if (s_nav_timer) {
+    app_timer_cancel(s_nav_timer);
+    s_nav_timer = NULL;
+  }
+  // Never started if the start is still queued
+  if (!outbox_cancel(REQUEST_START_THREADED_LOCATION)) {
+    outbox_push(REQUEST_STOP_THREADED_LOCATION);
+  }
+}
+
+typedef struct {
+  void (*start)(void);
+  void (*stop)(void);
+} ServiceProvider;
+
+static const ServiceProvider s_providers[] = {
+  [SERVICE_NONE]    = { NULL, NULL },
+  [SERVICE_TICK]    = { tick_service_start, tick_timer_service_unsubscribe },
+  [SERVICE_ACTIVITY] = { activity_service_start, activity_service_stop },
+  [SERVICE_BATTERY] = { battery_service_start, battery_state_service_unsubscribe },
+  [SERVICE_NAV]     = { nav_service_start, nav_service_stop }
+};
+
+static LocalService s_running_service = SERVICE_NONE;
+
+static void services_run(LocalService service) {
+  if (service == s_running_service) {
+    return;
+  }
+  if (s_providers[s_running_service].stop) {
+    s_providers[s_running_service].stop();
+  }
+  s_running_service = service;
+  if (s_providers[service].start) {
+    s_providers[service].start();
+  }
+}
+
+// Runs the service of the item on the current screen, if any
+static void services_update(void) {
+  const RequestInfo *request = request_get(screen_get_request(currentScreen, 0));
+  services_run(request ? request->service : SERVICE_NONE);
+}
+
+static void worker_message_handler(uint16_t type, AppWorkerMessage *data) {
+  PROFILE_BEGIN();
+  trace_worker(type, data);
+  if (type == WORKER_TOTALS) {
+    active_time = (uint32_t)data->data1 << 16 | data->data0;
+    if (s_worker_starting) {
+      // What was sent at launch was lost, the worker was not running yet
+      s_worker_starting = false;
+      worker_send(WORKER_LAUNCHED, s_config.still_rate, s_config.moving_rate);
+      if (s_running_service == SERVICE_ACTIVITY) {
+        worker_send(WORKER_WATCH, 0, 0);
+      }
+    }
+  } else if (type == WORKER_SUMMARY) {
+    s_activity.today = data->data0;
+    s_activity.yesterday = data->data1;
+    s_activity.week = data->data2;
+  }
+  if (s_running_service == SERVICE_ACTIVITY) {
+    show_active_time();
+  }
+  PROFILE_END(PROFILE_WORKER);
+}
+
+// Answers of the phone to the requests, and its own requests
+static void received_dispatch(DictionaryIterator *iter) {
+  if (dict_find(iter, KEY_STATS)) {
+    outbox_push(KEY_STATS);
+    return;
+  }
+  Tuple *result_tuple = dict_find(iter, PEBBLE_KEY_VALUE);
+  int id = tuple_is_int(result_tuple) ? tuple_int(result_tuple) : -1;
+  int shown = screen_get_request(currentScreen, 0);
+  const RequestInfo *request = request_get(id);
+
+  stats_answered(id);
+
+  position_store(iter);
+  sun_locate();
+  weather_store(iter);
+  if (id == REQUEST_START_THREADED_LOCATION) {
+    // Late frames after the screen changed are dropped
+    if (s_running_service == SERVICE_NAV) {
+      nav_frame(iter);
+    }
+    return;
+  }
+  if (id == REQUEST_WEATHER_ALL) {
+    s_weather_time = time(NULL);
+    request = request_get(shown);
+    if (request && request->source == SOURCE_WEATHER) {
+      request_show(shown, request);
+      prefetch_neighbours();
+    }
+    return;
+  }
+
+  if (id == REQUEST_FIX_LOCATION) {
+    nav_target_store(iter);
+    return;
+  }
+  // Other actions, like stopping the navigation stream, have nothing to
+  // show : their answer only acknowledges them, whatever screen is up now
+  if (request && !request->format) {
+    return;
+  }
+
+  if (!request) {
+    strcpy(text, "Error.\nPlease check your dictionary KEYS");
+    output_set_text(text);
+    return;
+  }
+
+  // Answers for other screens are only kept for when they are shown
+  if (request->source == SOURCE_WEATHER) {
+    if (id == shown) {
+      request_show(id, request);
+      prefetch_neighbours();
+    }
+    return;
+  }
+  if (id == REQUEST_TRANSPORT) {
+    timetable_store(iter);
+  }
+  // Answers for items no screen shows any more are dropped
+  Screen *entry = screen_of_item(id);
+  if (!entry) {
+    return;
+  }
+  entry->time = time(NULL);
+  request_format(request, iter, entry->text);
+  if (id == shown) {
+    if (id != REQUEST_TRANSPORT || !timetable_show()) {
+      output_set_text(entry->text);
+    }
+    prefetch_neighbours();
+  }
+}
+
+void received_handler(DictionaryIterator *iter, void *context) {
+  PROFILE_BEGIN();
+  trace_dictionary(TRACE_INBOX, iter);
+  received_dispatch(iter);
+  PROFILE_END(PROFILE_INBOX);
+}
+
+// Shows the item being chosen in the config window, inverted when it is the
+// one already assigned to the screen
+static void config_show_item(void) {
+  int val = screen_get_request(currentScreen, -1);
+
+  if (val != -1 && nbItem == val) {
+    text_layer_set_text_color(config_output_layer, GColorWhite);
+    text_layer_set_background_color(config_output_layer, GColorBlack);
+    window_set_background_color(config_window, GColorBlack);
+  } else {
+    text_layer_set_text_color(config_output_layer, GColorBlack);
+    text_layer_set_background_color(config_output_layer, GColorWhite);
+    window_set_background_color(config_window, GColorWhite);
+  }
+
+  const RequestInfo *request = request_get(nbItem);
+  text_layer_set_text(config_output_layer,
+                      request ? request->label : "Error.\nPlease check if NUMBER_OF_ITEMS is OK");
+  text_layer_set_text_alignment(config_output_layer, GTextAlignmentCenter);
+}
+
+// Shows the current screen number and asks for its item
+static void main_show_screen(void) {
+  snprintf(window_number, MAX_TEXT_SIZE, "Screen %d", currentScreen + 1);
+  text_layer_set_text(number_layer, window_number);
+  int id = screen_get_request(currentScreen, 0);
+  const RequestInfo *request = request_get(id);
+  request_send(id);
+  bool ticking = s_running_service == SERVICE_TICK;
+  services_update();
+  // Up time and transport share the tick service, which keeps running from
+  // one to the other : draw the new one without waiting for the next tick
+  if (ticking && s_running_service == SERVICE_TICK) {
+    tick_show();
+  }
+  // Nothing to wait for on a local item, look ahead right away
+  if (request && request->source == SOURCE_WATCH) {
+    prefetch_neighbours();
+  }
+}
+
+// Select action
+void select_click_handler(ClickRecognizerRef recognizer, void *context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_SELECT);
+  s_main_stale = true;
+  window_stack_push(s_menu_window, true);
+  PROFILE_END(PROFILE_CLICK);
+}
+
+// Up action
+void up_click_config_handler(ClickRecognizerRef recognizer, void *context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_UP);
+  if (nbItem + 1 > NUMBER_OF_ITEMS - 1) {
+    nbItem = 0;
+  } else {
+    nbItem = nbItem + 1;
+  }
+  //APP_LOG(APP_LOG_LEVEL_INFO, "UP : Sending request id : %d", nbItem);
+  config_show_item();
+  PROFILE_END(PROFILE_CLICK);
+}
+
+// down click
+void down_click_config_handler(ClickRecognizerRef recognizer, void *context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_DOWN);
+  if (nbItem - 1 < 0) {
+    nbItem = NUMBER_OF_ITEMS - 1;
+  } else {
+    nbItem = nbItem - 1;
+  }
+  //APP_LOG(APP_LOG_LEVEL_INFO, "DOWN : Sending request id : %d", nbItem);
+  config_show_item();
+  PROFILE_END(PROFILE_CLICK);
+}
+
+void up_main_click_handler(ClickRecognizerRef recognizer, void *context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_UP);
+  if (currentScreen + 1 >= s_config.num_screens) {
+    currentScreen = 0;
+  } else {
+    currentScreen = currentScreen + 1;
+  }
+  main_show_screen();
+  PROFILE_END(PROFILE_CLICK);
+}
+
+void down_main_click_handler(ClickRecognizerRef recognizer, void *context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_DOWN);
+  if (currentScreen - 1 < 0) {
+    currentScreen = s_config.num_screens - 1;
+  } else {
+    currentScreen = currentScreen - 1;
   }
+  main_show_screen();
+  PROFILE_END(PROFILE_CLICK);
+}
+
+void click_config_provider(void *context) {
+	window_single_click_subscribe(BUTTON_ID_UP, up_main_click_handler);
+  window_single_click_subscribe(BUTTON_ID_DOWN, down_main_click_handler);
+	window_single_click_subscribe(BUTTON_ID_SELECT, select_click_handler);
+}
+
+static void main_window_load(Window *window) {
+  snprintf(window_number, MAX_TEXT_SIZE, "Screen %d", currentScreen + 1);
   
   APP_LOG(APP_LOG_LEVEL_INFO, "Window : %s", window_number);
-  number_layer = text_layer_create(GRect(0, 0, bounds.size.w, 19)); // Change if you use PEBBLE_SDK 3
   text_layer_set_text(number_layer, window_number);
+  ((OutputData *)layer_get_data(output_layer))->text[0] = '\0';
+  request_send(screen_get_request(currentScreen, 0));
+}
+
+// Local items only update while the main window is on screen. Back from the
+// menu, the screen or its item may have changed.
+static void main_window_appear(Window *window) {
+  if (s_main_stale) {
+    s_main_stale = false;
+    main_show_screen();
+  } else {
+    services_update();
+  }
+}
+
+static void main_window_disappear(Window *window) {
+  services_run(SERVICE_NONE);
+}
+
+static void main_window_create(void) {
+  main_window = window_create();
+  window_set_click_config_provider(main_window, click_config_provider);
+  window_set_window_handlers(main_window, (WindowHandlers) {
+    .load = main_window_load,
+    .appear = main_window_appear,
+    .disappear = main_window_disappear,
+  });
+  Layer *window_layer = window_get_root_layer(main_window);
+  GRect bounds = layer_get_bounds(window_layer);
+
+  number_layer = text_layer_create(GRect(0, 0, bounds.size.w, 19)); // Change if you use PEBBLE_SDK 3
   text_layer_set_text_alignment(number_layer, GTextAlignmentCenter);
   text_layer_set_text_color(number_layer, GColorWhite);
   text_layer_set_background_color(number_layer, GColorBlack);
   layer_add_child(window_layer, text_layer_get_layer(number_layer));
 
-  output_layer = text_layer_create(GRect(0, 60, bounds.size.w, bounds.size.h)); // Change if you use PEBBLE_SDK 3
-  int cpt = persist_read_int(PERSIST_SCREEN1) ? persist_read_int(PERSIST_SCREEN1) : 0;
-  if (cpt < 13) {
-    //APP_LOG(APP_LOG_LEVEL_INFO, "Nav send : %d", cpt);
-	  send(cpt, "");
-  }
-  text_layer_set_text_alignment(output_layer, GTextAlignmentCenter);
-  layer_add_child(window_layer, text_layer_get_layer(output_layer));
+  output_layer = layer_create_with_data(GRect(0, 60, bounds.size.w, bounds.size.h), sizeof(OutputData)); // Change if you use PEBBLE_SDK 3
+  layer_set_update_proc(output_layer, output_update_proc);
+  layer_add_child(window_layer, output_layer);
 }
 
-static void main_window_unload(Window *window) {
-  text_layer_destroy(output_layer);
+static void main_window_destroy(void) {
+  layer_destroy(output_layer);
   text_layer_destroy(number_layer);
+  window_destroy(main_window);
 }
 
 static void config_click_handler(ClickRecognizerRef recognizer, void *context) {
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_SELECT);
   // Exit app after tea is done
   //APP_LOG(APP_LOG_LEVEL_INFO, "Current screen and nbItem : %d %d", currentScreen, nbItem);
-  switch(currentScreen) {
-    case 0:
-      persist_write_int(PERSIST_SCREEN1, nbItem);
-    break;
-    case 1:
-      persist_write_int(PERSIST_SCREEN2, nbItem);
-    break;
-    case 2:
-      persist_write_int(PERSIST_SCREEN3, nbItem);
-    break;
-    case 3:
-      persist_write_int(PERSIST_SCREEN4, nbItem);
-    break;
-  }
+  screen_set_request(currentScreen, nbItem);
+  config_save();
+  PROFILE_END(PROFILE_CLICK);
 }
 
 static void config_back_click_handler(ClickRecognizerRef recognizer, void *context) {
-  strcpy(text, "");
-  text_layer_set_text(output_layer, text);
+  PROFILE_BEGIN();
+  trace_click(BUTTON_ID_BACK);
   window_stack_pop(true); 
+  PROFILE_END(PROFILE_CLICK);
 }
 
 static void config_click_config_provider(void *context) {
@@ -676,166 +2087,241 @@ static void config_click_config_provider(void *context) {
 }
 
 static void config_window_load(Window *window) {
-  Layer *window_layer = window_get_root_layer(window);
-  GRect bounds = layer_get_bounds(window_layer);
+  nbItem = screen_get_request(currentScreen, 0);
+  
+  //APP_LOG(APP_LOG_LEVEL_INFO, "Config load : %d %d", currentScreen, nbItem);
 
-  window_set_click_config_provider(window, config_click_config_provider);
+  config_show_item();
+}
 
-  output_layer = text_layer_create(GRect(0, 60, bounds.size.w, bounds.size.h)); // Change if you use PEBBLE_SDK 3
-  int val = -1;
-  switch(currentScreen) {
-    case 0:
-      nbItem = persist_exists(PERSIST_SCREEN1) ? persist_read_int(PERSIST_SCREEN1) : 0;
-      val = persist_exists(PERSIST_SCREEN1) ? persist_read_int(PERSIST_SCREEN1) : -1;
-    break;
-    case 1:
-      nbItem = persist_exists(PERSIST_SCREEN2) ? persist_read_int(PERSIST_SCREEN2) : 0;
-      val = persist_exists(PERSIST_SCREEN2) ? persist_read_int(PERSIST_SCREEN2) : -1;
-    break;
-    case 2:
-      nbItem = persist_exists(PERSIST_SCREEN3) ? persist_read_int(PERSIST_SCREEN3) : 0;
-      val = persist_exists(PERSIST_SCREEN3) ? persist_read_int(PERSIST_SCREEN3) : -1;
-    break;
-    case 3:
-      nbItem = persist_exists(PERSIST_SCREEN4) ? persist_read_int(PERSIST_SCREEN4) : 0;
-      val = persist_exists(PERSIST_SCREEN4) ? persist_read_int(PERSIST_SCREEN4) : -1;
-    break;
-  }
+static void config_window_create(void) {
+  config_window = window_create();
+  window_set_click_config_provider(config_window, config_click_config_provider);
+  window_set_window_handlers(config_window, (WindowHandlers){
+    .load = config_window_load,
+  });
+  Layer *window_layer = window_get_root_layer(config_window);
+  GRect bounds = layer_get_bounds(window_layer);
+
+  config_output_layer = text_layer_create(GRect(0, 60, bounds.size.w, bounds.size.h)); // Change if you use PEBBLE_SDK 3
+  layer_add_child(window_layer, text_layer_get_layer(config_output_layer));
   
-  //APP_LOG(APP_LOG_LEVEL_INFO, "Config load : %d %d", currentScreen, nbItem);
+  config_number_layer = text_layer_create(GRect(0, 0, bounds.size.w, 19)); // Change if you use PEBBLE_SDK 3
+  text_layer_set_text(config_number_layer, "Choose the item");
+  text_layer_set_text_alignment(config_number_layer, GTextAlignmentCenter);
+  text_layer_set_text_color(config_number_layer, GColorWhite);
+  text_layer_set_background_color(config_number_layer, GColorBlack);
+  layer_add_child(window_layer, text_layer_get_layer(config_number_layer));
+}
 
-  if (val != -1 && nbItem == val) {
-    text_layer_set_text_color(output_layer, GColorWhite);
-    text_layer_set_background_color(output_layer, GColorBlack);
-    window_set_background_color(config_window, GColorBlack);
+static void config_window_destroy(void) {
+  text_layer_destroy(config_output_layer);
+  text_layer_destroy(config_number_layer);
+  window_destroy(config_window);
+}
+
+// Round trip stats, one line per request id answered : its count and the
+// buckets of the median and 90th percentile answers
+#define DIAG_TEXT_SIZE 256
+
+static char s_diag_text[DIAG_TEXT_SIZE];
+
+static void builder_append_bucket(TextBuilder *builder, int bucket) {
+  if (bucket < STATS_BUCKETS - 1) {
+    builder_append(builder, " <");
+    builder_append_int(builder, s_latency_bounds[bucket]);
   } else {
-    text_layer_set_text_color(output_layer, GColorBlack);
-    text_layer_set_background_color(output_layer, GColorWhite);
-    window_set_background_color(config_window, GColorWhite);
+    builder_append(builder, " >");
+    builder_append_int(builder, s_latency_bounds[STATS_BUCKETS - 2]);
   }
-  
-  switch (nbItem) {
-    case REQUEST_LOCATION:
-      strcpy(text, "LOCATION");
-      break;
-    case REQUEST_FIX_LOCATION:
-      strcpy(text, "FIXING TARGET");
-      break;
-    case REQUEST_START_THREADED_LOCATION:
-      strcpy(text, "START THREAD NAVIGATION");
-      break;
-    case REQUEST_STOP_THREADED_LOCATION:
-      strcpy(text, "STOP THREAD NAVIGATION");
-      break;
-    case REQUEST_ELEVATION:
-      strcpy(text, "ELEVATION");
-      break;
-    case REQUEST_WEATHER_STATUS:
-      strcpy(text, "WEATHER_STATUS");
-      break;
-    case REQUEST_WEATHER_TEMPERATURE:
-      strcpy(text, "TEMPERATURE");
-      break;
-    case REQUEST_WEATHER_PRESSURE:
-      strcpy(text, "PRESSURE");
-      break;
-    case REQUEST_WEATHER_HUMIDITY:
-      strcpy(text, "HUMIDITY");
-      break;
-    case REQUEST_WEATHER_WIND:
-      strcpy(text, "WIND");
-      break;
-    case REQUEST_WEATHER_SUNRISE:
-      strcpy(text, "SUNRISE");
-      break;
-    case REQUEST_WEATHER_SUNSET:
-      strcpy(text, "SUNSET");
-      break;
-    case REQUEST_TRANSPORT:
-      strcpy(text, "TRANSPORT");
-      break;
-    case SHOW_UP_TIME:
-      strcpy(text, "SHOW_UP_TIME");
-      break;
-    case SHOW_ACTIVE_TIME:
-      strcpy(text, "SHOW_ACTIVE_TIME");
-      break;
-    case SHOW_BATTERY_STATE:
-      strcpy(text, "SHOW_BATTERY_STATE");
-      break;
-    default:
-      strcpy(text, "Error.\nPlease check if NUMBER_OF_ITEMS is OK");
-      break;
+}
+
+#ifdef PROFILE
+static bool s_diag_profile = false;   // Page shown, select switches it
+
+// Calls per hour since launch, cumulated and max ms of each handler
+static void diag_profile(TextBuilder *builder) {
+  uint32_t uptime = time(NULL) - launch_time;
+  builder_append(builder, "calls/h, ms, max ms");
+  for (int i = 0; i < PROFILE_COUNT; i++) {
+    builder_append(builder, "\n");
+    builder_append(builder, s_profile_names[i]);
+    builder_append(builder, " ");
+    builder_append_int(builder, (uint64_t)s_profile[i].calls * 3600 / (uptime ? uptime : 1));
+    builder_append(builder, " ");
+    builder_append_int(builder, s_profile[i].ms);
+    builder_append(builder, " ");
+    builder_append_int(builder, s_profile[i].max_ms);
   }
-  text_layer_set_text(output_layer, text);
-  text_layer_set_text_alignment(output_layer, GTextAlignmentCenter);
-  layer_add_child(window_layer, text_layer_get_layer(output_layer));
-  
-  number_layer = text_layer_create(GRect(0, 0, bounds.size.w, 19)); // Change if you use PEBBLE_SDK 3
-  text_layer_set_text(number_layer, "Choose the item");
-  text_layer_set_text_alignment(number_layer, GTextAlignmentCenter);
-  text_layer_set_text_color(number_layer, GColorWhite);
-  text_layer_set_background_color(number_layer, GColorBlack);
-  layer_add_child(window_layer, text_layer_get_layer(number_layer));
+}
+#endif
+
+static void diag_show(void) {
+  stats_expire(clock_ms());
+  TextBuilder builder;
+  builder_init(&builder, s_diag_text, DIAG_TEXT_SIZE);
+#ifdef PROFILE
+  if (s_diag_profile) {
+    diag_profile(&builder);
+    text_layer_set_text(s_diag_layer, s_diag_text);
+    return;
+  }
+#endif
+  builder_append(&builder, "sent ");
+  builder_append_int(&builder, s_stats.sent);
+  builder_append(&builder, " failed ");
+  builder_append_int(&builder, s_stats.failed);
+  builder_append(&builder, "\ndropped ");
+  builder_append_int(&builder, s_stats.dropped);
+  builder_append(&builder, " timeouts ");
+  builder_append_int(&builder, s_stats.timeouts);
+  builder_append(&builder, "\nheap ");
+  builder_append_int(&builder, heap_bytes_used());
+  builder_append(&builder, " bytes\nn, p50, p90 in ms");
+  for (int id = 0; id < STATS_TYPES; id++) {
+    uint32_t count = stats_count(id);
+    if (count == 0) {
+      continue;
+    }
+    builder_append(&builder, "\n");
+    builder_append(&builder, id == REQUEST_WEATHER_ALL ? "WEATHER" : s_requests[id].label);
+    builder_append(&builder, " ");
+    builder_append_int(&builder, count);
+    builder_append_bucket(&builder, stats_percentile(id, 50));
+    builder_append_bucket(&builder, stats_percentile(id, 90));
+  }
+  text_layer_set_text(s_diag_layer, s_diag_text);
+}
+
+static void diag_tick_handler(struct tm *tick_time, TimeUnits units_changed) {
+  PROFILE_BEGIN();
+  diag_show();
+  PROFILE_END(PROFILE_TICK);
+}
+
+#ifdef PROFILE
+static void diag_select_click_handler(ClickRecognizerRef recognizer, void *context) {
+  s_diag_profile = !s_diag_profile;
+  diag_show();
+}
+
+static void diag_click_config_provider(void *context) {
+  window_single_click_subscribe(BUTTON_ID_SELECT, diag_select_click_handler);
+}
+#endif
+
+// Refreshed every second while shown, for the timeouts
+static void diag_window_appear(Window *window) {
+  diag_show();
+  tick_timer_service_subscribe(SECOND_UNIT, diag_tick_handler);
+}
+
+static void diag_window_disappear(Window *window) {
+  tick_timer_service_unsubscribe();
+}
+
+static void diag_window_create(void) {
+  s_diag_window = window_create();
+#ifdef PROFILE
+  window_set_click_config_provider(s_diag_window, diag_click_config_provider);
+#endif
+  window_set_window_handlers(s_diag_window, (WindowHandlers){
+    .appear = diag_window_appear,
+    .disappear = diag_window_disappear,
+  });
+  Layer *window_layer = window_get_root_layer(s_diag_window);
+  GRect bounds = layer_get_bounds(window_layer);
+
+  s_diag_layer = text_layer_create(bounds);
+  text_layer_set_font(s_diag_layer, fonts_get_system_font(FONT_KEY_GOTHIC_14));
+  layer_add_child(window_layer, text_layer_get_layer(s_diag_layer));
 }
 
-static void config_window_unload(Window *window) {
-  text_layer_destroy(output_layer);
+static void diag_window_destroy(void) {
+  text_layer_destroy(s_diag_layer);
+  window_destroy(s_diag_window);
 }
 
-void out_sent_handler(DictionaryIterator *sent, void *context){}
-static void out_fail_handler(DictionaryIterator *failed, AppMessageResult reason, void* context){}
+void out_sent_handler(DictionaryIterator *sent, void *context) {
+  PROFILE_BEGIN();
+  trace_outbox_done(APP_MSG_OK);
+  if (s_outbox_in_flight) {
+    s_outbox_in_flight = false;
+    outbox_pop();
+    outbox_pump();
+  }
+  PROFILE_END(PROFILE_OUTBOX);
+}
 
-static void in_received_handler(DictionaryIterator *iter, void* context){}
+static void out_fail_handler(DictionaryIterator *failed, AppMessageResult reason, void* context) {
+  PROFILE_BEGIN();
+  trace_outbox_done(reason);
+  s_stats.failed++;
+  if (s_outbox_in_flight) {
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Outbox send of %d failed : %d", s_outbox[0].request, reason);
+    s_outbox_in_flight = false;
+    outbox_retry_later();
+  }
+  PROFILE_END(PROFILE_OUTBOX);
+}
 
-void in_drop_handler(AppMessageResult reason, void *context){}
+void in_drop_handler(AppMessageResult reason, void *context) {
+  PROFILE_BEGIN();
+  s_stats.dropped++;
+  PROFILE_END(PROFILE_INBOX);
+}
 
 /**
  * Initializes
  */
 static void init(void) {
-
-  
-  // Subscribe to TickTimerService
-  tick_timer_service_subscribe(SECOND_UNIT, tick_handler);
-  
-  // Subscribe to the accelerometer data service
-  accel_data_service_subscribe(NUM_ACCEL_SAMPLES, data_handler);
-  // Choose update rate
-  accel_service_set_sampling_rate(ACCEL_SAMPLING_10HZ);
+  launch_time = time(NULL);
+  config_load();
+  trace_persist(PERSIST_CONFIG, &s_config, sizeof(s_config));
+  s_target_set = persist_read_data(PERSIST_TARGET, &s_target, sizeof(s_target)) == sizeof(s_target);
+  if (s_target_set) {
+    trace_persist(PERSIST_TARGET, &s_target, sizeof(s_target));
+  }
+  if (persist_read_data(PERSIST_SUN, &s_sun, sizeof(s_sun)) == sizeof(s_sun)) {
+    trace_persist(PERSIST_SUN, &s_sun, sizeof(s_sun));
+  } else {
+    memset(&s_sun, 0, sizeof(s_sun));
+  }
 
   app_message_register_inbox_received(received_handler);
   app_message_register_outbox_sent(out_sent_handler);
   app_message_register_inbox_dropped(in_drop_handler);
   app_message_register_outbox_failed(out_fail_handler);
   
-  app_message_open(app_message_inbox_size_maximum(), app_message_outbox_size_maximum());
+  app_message_open(INBOX_SIZE, OUTBOX_SIZE);
 
-  
-  
-  main_window = window_create();
-  window_set_click_config_provider(main_window, click_config_provider);
-  window_set_window_handlers(main_window, (WindowHandlers) {
-    .load = main_window_load,
-    .unload = main_window_unload,
-  });
+  // Activity is counted by the worker, started once and left running
+  app_worker_message_subscribe(worker_message_handler);
+  if (!app_worker_is_running()) {
+    s_worker_starting = app_worker_launch() == APP_WORKER_RESULT_SUCCESS;
+  }
+  worker_send(WORKER_LAUNCHED, s_config.still_rate, s_config.moving_rate);
+
+
+  // Every window and layer is created here once and kept until exit, the
+  // load handlers only fill them in, so going through the menus all day
+  // does not allocate
+  main_window_create();
+  menu_window_create();
+  config_window_create();
+  diag_window_create();
   window_stack_push(main_window, true);
-  
-   s_menu_window = window_create();
-   window_set_window_handlers(s_menu_window, (WindowHandlers){
-     .load = menu_window_load,
-     .unload = menu_window_unload,
-   });
-  
-  config_window = window_create();
-  window_set_window_handlers(config_window, (WindowHandlers){
-    .load = config_window_load,
-    .unload = config_window_unload,
-  });
 }
   
 static void deinit(void) {
-  window_destroy(main_window);
+  services_run(SERVICE_NONE);
+  app_worker_message_unsubscribe();
+  config_save();
+  profile_log();
+  diag_window_destroy();
+  config_window_destroy();
+  menu_window_destroy();
+  main_window_destroy();
 }
 
 /**
@@ -845,4 +2331,5 @@ int main(void) {
   init();
   app_event_loop();
   deinit();
+  return 0;
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include <pebble.h>
+#include "sun.h"
+
+#define SUN_J2000           946728000   // 2000-01-01 12:00 UTC
+#define SUN_DAY_S           86400
+#define SUN_HORIZON         -833000     // Refraction and radius of the sun, millionths of a degree
+#define SUN_OBLIQUITY       23439700
+#define SUN_PERIHELION      102937200
+
+static int32_t sun_wrap(int64_t angle) {
+  int64_t a = angle % 360000000;
+  return a < 0 ? a + 360000000 : a;
+}
+
+// Mean anomaly and ecliptic longitude of the sun at s from J2000, the
+// anomaly moving 0.98560028 degree a day
+static int32_t sun_ecliptic(int64_t at, int32_t *anomaly) {
+  *anomaly = sun_wrap(357529100 + at * 98560028 / (SUN_DAY_S * 100));
+  int64_t centre = (1914800 * (int64_t)geo_sin(*anomaly) + 20000 * (int64_t)geo_sin(sun_wrap(2LL * *anomaly)) +
+                    300 * (int64_t)geo_sin(sun_wrap(3LL * *anomaly))) >> 30;
+  return sun_wrap(*anomaly + centre + 180000000 + SUN_PERIHELION);
+}
+
+// Half the time in s the sun is above the horizon at s from J2000, by the
+// declination then. False when it does not cross the horizon.
+static bool sun_half_day(const GeoPoint *position, int64_t at, int64_t *half_day) {
+  int32_t anomaly;
+  int32_t ecliptic = sun_ecliptic(at, &anomaly);
+  int32_t declination = geo_asin((int64_t)geo_sin(ecliptic) * geo_sin(SUN_OBLIQUITY) >> 30);
+  int64_t below = (int64_t)geo_cos(position->lat) * geo_cos(declination) >> 30;
+  int64_t above = (int64_t)geo_sin(SUN_HORIZON) * GEO_ONE - (int64_t)geo_sin(position->lat) * geo_sin(declination);
+  if (below == 0 || above >= below * GEO_ONE || above <= -below * GEO_ONE) {
+    return false;
+  }
+  // A degree of hour angle is 240 s
+  *half_day = (int64_t)geo_acos(above / below) * 6 / 25000;
+  return true;
+}
+
+bool sun_times(const GeoPoint *position, uint32_t day, time_t *rise, time_t *set) {
+  // Mean solar noon, 240 s earlier a degree east, and the transit with the
+  // equation of time (0.0053 and 0.0069 of a day)
+  int64_t noon = (int64_t)day * SUN_DAY_S + SUN_DAY_S / 2 - SUN_J2000 - (int64_t)position->lon * 6 / 25000;
+  int32_t anomaly;
+  int32_t ecliptic = sun_ecliptic(noon, &anomaly);
+  int64_t transit = noon + ((458 * (int64_t)geo_sin(anomaly) -
+                             596 * (int64_t)geo_sin(sun_wrap(2LL * ecliptic)) + (1 << 29)) >> 30);
+
+  // The declination moves over the day, taken again at each event for
+  // high latitudes
+  int64_t half_day, half_rise, half_set;
+  if (!sun_half_day(position, transit, &half_day) ||
+      !sun_half_day(position, transit - half_day, &half_rise) ||
+      !sun_half_day(position, transit + half_day, &half_set)) {
+    return false;
+  }
+  *rise = SUN_J2000 + transit - half_rise;
+  *set = SUN_J2000 + transit + half_set;
+  return true;
+}
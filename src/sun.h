@@ -0,0 +1,13 @@
+#pragma once
+
+#include <pebble.h>
+#include "geo.h"
+
+// Sunrise and sunset from the date and the position, in integers only
+// (geo.h), by the sunrise equation with the mean anomaly, the equation of
+// the centre and the obliquity of the ecliptic. Within a minute of the
+// tables up to the polar circles.
+
+// Sunrise and sunset of a day (time / 86400) at a position, in UTC seconds
+// since 1970. False when the sun stays up or down all day.
+bool sun_times(const GeoPoint *position, uint32_t day, time_t *rise, time_t *set);
@@ -0,0 +1,37 @@
+#pragma once
+
+// Session traces : every dictionary received or sent, worker message and
+// click of a session with its time, so that it can be replayed on the host by
+// `ihm-bench --replay` (host/replay.c).
+//
+// A trace is TRACE_MAGIC followed by records, all numbers little-endian :
+//
+//   uint32  ms since the start of the trace
+//   uint8   TraceType
+//   uint16  payload size
+//   payload TRACE_PERSIST : uint32 key, then the data stored under it
+//           TRACE_INBOX / TRACE_OUTBOX : the dictionary bytes
+//           TRACE_OUTBOX_DONE : uint32 AppMessageResult of the last send
+//           TRACE_ACCEL : no longer recorded, activity is counted by the worker
+//           TRACE_CLICK : the ButtonId as one byte
+//           TRACE_WORKER : type, data0, data1, data2 as uint16
+//
+// The settings are recorded as TRACE_PERSIST at init so the replay starts
+// from the same screens.
+//
+// On the watch the bytes are logged in hex on "TRACE " lines, the replay
+// reads the output of `pebble logs` as well as a binary trace.
+
+#define TRACE_MAGIC         "IHMT1"
+#define TRACE_MAGIC_SIZE    5
+#define TRACE_HEADER_SIZE   7
+
+typedef enum {
+  TRACE_PERSIST = 1,
+  TRACE_INBOX,
+  TRACE_OUTBOX,
+  TRACE_OUTBOX_DONE,
+  TRACE_ACCEL,
+  TRACE_CLICK,
+  TRACE_WORKER
+} TraceType;
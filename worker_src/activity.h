@@ -0,0 +1,19 @@
+#pragma once
+
+// Messages between the app and the activity worker (worker_src/worker.c),
+// which counts the time the wearer moves whether the app is open or not.
+
+#define PERSIST_ACTIVE_TIME 100   // Worker keys from here, uint32 s of activity
+#define PERSIST_ACTIVITY_RATES 114 // After the history keys, still | moving rate << 8
+
+// The worker starts after the app that launched it, which would lose what
+// the app sent before. So the worker sends its totals once started, and the
+// app answers the first ones with WORKER_LAUNCHED, and WORKER_WATCH if shown.
+
+typedef enum {
+  WORKER_LAUNCHED,    // App started : data0 still and data1 moving AccelSamplingRate
+  WORKER_WATCH,       // App shows the active time : send the totals on every change
+  WORKER_UNWATCH,     // App no longer shows it
+  WORKER_TOTALS,      // Worker : s of activity, data0 low and data1 high 16 bits, also on start
+  WORKER_SUMMARY      // Worker : minutes of activity today, yesterday and over the last 7 days
+} WorkerMessageType;
@@ -0,0 +1,177 @@
+#include <pebble_worker.h>
+#include "history.h"
+
+typedef struct {
+  uint32_t start;                       // Minute of the first record
+  uint8_t length;
+  uint8_t data[HISTORY_CHUNK_SIZE];
+} HistoryChunk;
+
+typedef struct {
+  uint32_t minute;                      // Next minute to record, 0 before the first
+  uint32_t hour;                        // Hour of the last minute recorded
+  uint32_t day;
+  uint8_t head;                         // Chunk being filled
+  uint8_t count;                        // Full chunks before the head
+  uint16_t hour_seconds;                // Of the current hour, exact
+  uint32_t days[HISTORY_DAYS];          // s active, by day % HISTORY_DAYS
+  uint8_t hours[HISTORY_HOURS];         // HISTORY_HOUR_UNIT_S active, by hour % HISTORY_HOURS
+} HistorySummary;
+
+static HistorySummary s_history;
+static HistoryChunk s_history_chunk;    // The head, persisted by history_save
+
+static void history_reset(uint32_t minute) {
+  memset(&s_history, 0, sizeof(s_history));
+  s_history.minute = minute;
+  s_history.hour = minute / 60;
+  s_history.day = minute / (24 * 60);
+  s_history_chunk.start = minute;
+  s_history_chunk.length = 0;
+}
+
+void history_load(void) {
+  if (persist_read_data(PERSIST_HISTORY, &s_history, sizeof(s_history)) != sizeof(s_history) ||
+      persist_read_data(PERSIST_HISTORY_CHUNK + s_history.head, &s_history_chunk,
+                        sizeof(s_history_chunk)) <= 0) {
+    history_reset(0);
+  }
+}
+
+void history_save(void) {
+  if (s_history.minute != 0) {
+    persist_write_data(PERSIST_HISTORY, &s_history, sizeof(s_history));
+    persist_write_data(PERSIST_HISTORY_CHUNK + s_history.head, &s_history_chunk, sizeof(s_history_chunk));
+  }
+}
+
+// Appends a record, persisting the head and starting the next chunk when it
+// is full
+static void history_put(uint32_t minute, uint8_t record) {
+  if (s_history_chunk.length == HISTORY_CHUNK_SIZE) {
+    persist_write_data(PERSIST_HISTORY_CHUNK + s_history.head, &s_history_chunk, sizeof(s_history_chunk));
+    s_history.head = (s_history.head + 1) % HISTORY_CHUNKS;
+    if (s_history.count < HISTORY_CHUNKS - 1) {
+      s_history.count++;
+    }
+    s_history_chunk.start = minute;
+    s_history_chunk.length = 0;
+  }
+  s_history_chunk.data[s_history_chunk.length++] = record;
+}
+
+static void history_put_idle(uint32_t minute, uint32_t minutes) {
+  while (minutes > 0) {
+    uint8_t *last = s_history_chunk.length ? &s_history_chunk.data[s_history_chunk.length - 1] : NULL;
+    uint32_t run = 0;
+    if (last && (*last & HISTORY_IDLE)) {
+      uint32_t room = HISTORY_IDLE_MAX - ((*last & ~HISTORY_IDLE) + 1);
+      run = minutes < room ? minutes : room;
+      *last += run;
+    }
+    if (run == 0) {
+      run = minutes < HISTORY_IDLE_MAX ? minutes : HISTORY_IDLE_MAX;
+      history_put(minute, HISTORY_IDLE | (run - 1));
+    }
+    minute += run;
+    minutes -= run;
+  }
+}
+
+// Moves the totals to the hour and day of minute, clearing the ones skipped
+static void history_advance(uint32_t minute) {
+  uint32_t hour = minute / 60;
+  uint32_t day = minute / (24 * 60);
+  for (uint32_t i = 1; s_history.hour + i <= hour && i <= HISTORY_HOURS; i++) {
+    s_history.hours[(s_history.hour + i) % HISTORY_HOURS] = 0;
+  }
+  if (hour != s_history.hour) {
+    s_history.hour = hour;
+    s_history.hour_seconds = 0;
+  }
+  for (uint32_t i = 1; s_history.day + i <= day && i <= HISTORY_DAYS; i++) {
+    s_history.days[(s_history.day + i) % HISTORY_DAYS] = 0;
+  }
+  s_history.day = day;
+}
+
+void history_add(uint32_t minute, uint16_t active_s) {
+  if (s_history.minute == 0 || minute >= s_history.minute + HISTORY_DAYS * 24 * 60) {
+    history_reset(minute);
+  } else if (minute < s_history.minute) {
+    return;
+  }
+  if (active_s > 60) {
+    active_s = 60;
+  }
+  history_put_idle(s_history.minute, minute - s_history.minute);
+  if (active_s == 0) {
+    history_put_idle(minute, 1);
+  } else {
+    history_put(minute, active_s);
+  }
+  s_history.minute = minute + 1;
+
+  history_advance(minute);
+  s_history.hour_seconds += active_s;
+  s_history.hours[s_history.hour % HISTORY_HOURS] =
+    (s_history.hour_seconds + HISTORY_HOUR_UNIT_S / 2) / HISTORY_HOUR_UNIT_S;
+  s_history.days[s_history.day % HISTORY_DAYS] += active_s;
+}
+
+uint32_t history_hour_seconds(uint32_t hour) {
+  if (s_history.minute == 0 || hour > s_history.hour || hour + HISTORY_HOURS <= s_history.hour) {
+    return 0;
+  }
+  if (hour == s_history.hour) {
+    return s_history.hour_seconds;
+  }
+  return s_history.hours[hour % HISTORY_HOURS] * HISTORY_HOUR_UNIT_S;
+}
+
+uint32_t history_day_seconds(uint32_t day) {
+  if (s_history.minute == 0 || day > s_history.day || day + HISTORY_DAYS <= s_history.day) {
+    return 0;
+  }
+  return s_history.days[day % HISTORY_DAYS];
+}
+
+// Chunk i from the oldest one, the head being the last
+static const HistoryChunk *history_chunk(int i, HistoryChunk *buffer) {
+  if (i == s_history.count) {
+    return &s_history_chunk;
+  }
+  int key = (s_history.head + HISTORY_CHUNKS - s_history.count + i) % HISTORY_CHUNKS;
+  if (persist_read_data(PERSIST_HISTORY_CHUNK + key, buffer, sizeof(*buffer)) <= 0) {
+    buffer->length = 0;
+  }
+  return buffer;
+}
+
+uint32_t history_range_seconds(uint32_t from, uint32_t to) {
+  uint32_t seconds = 0;
+  HistoryChunk buffer;
+  for (int i = 0; i <= s_history.count; i++) {
+    const HistoryChunk *chunk = history_chunk(i, &buffer);
+    uint32_t minute = chunk->start;
+    for (int j = 0; j < chunk->length && minute < to; j++) {
+      uint8_t record = chunk->data[j];
+      if (record & HISTORY_IDLE) {
+        minute += (record & ~HISTORY_IDLE) + 1;
+      } else {
+        seconds += minute >= from ? record : 0;
+        minute++;
+      }
+    }
+  }
+  return seconds;
+}
+
+uint32_t history_size(void) {
+  return s_history.count * HISTORY_CHUNK_SIZE + s_history_chunk.length;
+}
+
+uint32_t history_first_minute(void) {
+  HistoryChunk buffer;
+  return history_chunk(0, &buffer)->start;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <pebble_worker.h>
+
+// Activity of the last days, kept by the worker.
+//
+// Every minute is one byte of seconds active (1 to 60), or a run of idle
+// minutes in one byte (HISTORY_IDLE | minutes - 1). The bytes fill chunks of
+// HISTORY_CHUNK_SIZE persisted under their own key as each one fills, in a
+// ring of HISTORY_CHUNKS that forgets the oldest chunk.
+//
+// Totals per hour and per day are kept apart for the last HISTORY_HOURS and
+// HISTORY_DAYS, so that summaries never read the minutes. They hold the
+// whole week whatever the minutes compress to.
+
+#define PERSIST_HISTORY         101   // HistorySummary
+#define PERSIST_HISTORY_CHUNK   102   // First of HISTORY_CHUNKS keys
+
+#define HISTORY_CHUNKS          12
+#define HISTORY_CHUNK_SIZE      248   // Records per chunk, under PERSIST_DATA_MAX_LENGTH with the header
+#define HISTORY_HOURS           168
+#define HISTORY_DAYS            8     // Today and the 7 days before
+#define HISTORY_HOUR_UNIT_S     15    // Resolution of the past hours
+#define HISTORY_IDLE            0x80
+#define HISTORY_IDLE_MAX        128
+
+// Reads the history back at launch, and writes what is not persisted yet
+void history_load(void);
+void history_save(void);
+
+// Records the seconds active of a minute (time(NULL) / 60) that is over.
+// Minutes skipped since the last one count as idle, minutes not after it
+// (clock set back) are dropped.
+void history_add(uint32_t minute, uint16_t active_s);
+
+// Seconds active in an hour (time(NULL) / 3600) or a day (time(NULL) /
+// 86400), 0 out of the period kept. Past hours are rounded to
+// HISTORY_HOUR_UNIT_S.
+uint32_t history_hour_seconds(uint32_t hour);
+uint32_t history_day_seconds(uint32_t day);
+
+// Seconds active in the minutes [from, to) still in the chunks, read from
+// the records
+uint32_t history_range_seconds(uint32_t from, uint32_t to);
+
+// Bytes of minute records kept, and the first minute they cover
+uint32_t history_size(void);
+uint32_t history_first_minute(void);
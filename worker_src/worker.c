@@ -0,0 +1,179 @@
+#include <pebble_worker.h>
+#include "activity.h"
+#include "history.h"
+
+// Counts the time the wearer moves in the background, so it goes on while
+// the app is closed. The app gets the totals by messages (activity.h).
+
+#define ACCEL_BATCH_SIZE    25      // Max samples per update allowed by the SDK
+#define ACCEL_MOTION_SAMPLES 3      // Active samples in a batch to speed up sampling
+#define ACCEL_STILL_BATCHES 4       // Still batches in a row to slow it down again
+#define GRAVITY             1000000 // (1g)² = 1000 000 mg²
+#define ACCEL_THRESHOLD     800000
+#define ACTIVITY_SAVE_S     900     // Min s between two writes of the total
+
+static AccelSamplingRate s_still_rate = ACCEL_SAMPLING_10HZ;
+static AccelSamplingRate s_moving_rate = ACCEL_SAMPLING_25HZ;
+static AccelSamplingRate s_rate = ACCEL_SAMPLING_10HZ;
+static int s_still_batches = 0;
+
+static uint32_t s_active_s = 0;     // Total, what the app shows
+static uint16_t s_active_ms = 0;    // Below one second, not sent
+static time_t s_saved_time = 0;
+static bool s_unsaved = false;      // Active minutes since the last save
+static bool s_watched = false;      // App showing the total
+static uint32_t s_minute = 0;       // time(NULL) / 60 of the minute being counted
+static uint32_t s_minute_ms = 0;    // Active in that minute
+
+static void activity_send_totals(void) {
+  AppWorkerMessage message = { .data0 = s_active_s & 0xFFFF, .data1 = s_active_s >> 16 };
+  app_worker_send_message(WORKER_TOTALS, &message);
+}
+
+// Today, yesterday and the last 7 days in minutes, from the history totals
+static void activity_send_summary(void) {
+  uint32_t today = time(NULL) / (24 * 60 * 60);
+  uint32_t week = 0;
+  for (uint32_t day = today - 6; day <= today; day++) {
+    week += history_day_seconds(day);
+  }
+  AppWorkerMessage message = {
+    .data0 = history_day_seconds(today) / 60,
+    .data1 = history_day_seconds(today - 1) / 60,
+    .data2 = week / 60
+  };
+  app_worker_send_message(WORKER_SUMMARY, &message);
+}
+
+static void activity_save(void) {
+  persist_write_int(PERSIST_ACTIVE_TIME, s_active_s);
+  history_save();
+  s_saved_time = time(NULL);
+  s_unsaved = false;
+}
+
+// Hands the minute that is over to the history. Idle minutes need no save,
+// the ones lost are idle again when read back.
+static void activity_minute(uint32_t minute) {
+  uint16_t active_s = (s_minute_ms + 500) / 1000;
+  if (s_minute != 0) {
+    history_add(s_minute, active_s);
+    if (s_watched) {
+      activity_send_summary();
+    }
+  }
+  s_minute = minute;
+  s_minute_ms = 0;
+  s_unsaved |= active_s > 0;
+  if (s_unsaved && time(NULL) - s_saved_time >= ACTIVITY_SAVE_S) {
+    activity_save();
+  }
+}
+
+static void activity_set_rate(AccelSamplingRate rate) {
+  if (rate != s_rate) {
+    s_rate = rate;
+    accel_service_set_sampling_rate(rate);
+  }
+}
+
+static void accel_handler(AccelData *data, uint32_t num_samples) {  // accel from -4000 to 4000, 1g = 1000 mg
+  int active_samples = 0;
+  for (uint32_t i = 0; i < num_samples; i++) {
+    int32_t x = data[i].x;
+    int32_t y = data[i].y;
+    int32_t z = data[i].z;
+    int32_t acc_norm_2 = (x*x) + (y*y) + (z*z);  // (1g)² = 1000 000
+    if ( ((acc_norm_2 - GRAVITY) > ACCEL_THRESHOLD) || ((GRAVITY - acc_norm_2) > ACCEL_THRESHOLD) ) {
+      active_samples++;
+    }
+  }
+
+  // Each sample stands for one sampling period. The app only hears of
+  // whole seconds, the history of whole minutes.
+  uint32_t minute = time(NULL) / 60;
+  if (minute != s_minute) {
+    activity_minute(minute);
+  }
+  s_minute_ms += active_samples * 1000 / s_rate;
+  uint32_t active_ms = s_active_ms + active_samples * 1000 / s_rate;
+  if (active_ms >= 1000) {
+    s_active_s += active_ms / 1000;
+    if (s_watched) {
+      activity_send_totals();
+    }
+  }
+  s_active_ms = active_ms % 1000;
+
+  // Sample faster while the wearer moves, and back to the slowest rate (so
+  // the fewest wakeups per hour) once still for a few batches
+  if (active_samples >= ACCEL_MOTION_SAMPLES) {
+    s_still_batches = 0;
+    activity_set_rate(s_moving_rate);
+  } else if (++s_still_batches >= ACCEL_STILL_BATCHES) {
+    activity_set_rate(s_still_rate);
+  }
+}
+
+// The rates of the app config, kept for the starts without the app
+static void activity_set_rates(AccelSamplingRate still_rate, AccelSamplingRate moving_rate) {
+  if (still_rate != s_still_rate || moving_rate != s_moving_rate) {
+    s_still_rate = still_rate;
+    s_moving_rate = moving_rate;
+    persist_write_int(PERSIST_ACTIVITY_RATES, still_rate | moving_rate << 8);
+  }
+}
+
+static void activity_message_handler(uint16_t type, AppWorkerMessage *data) {
+  switch (type) {
+    case WORKER_LAUNCHED:
+      if (data->data0 && data->data1) {
+        activity_set_rates(data->data0, data->data1);
+      }
+      activity_send_totals();
+      activity_send_summary();
+      break;
+    case WORKER_WATCH:
+      s_watched = true;
+      activity_send_totals();
+      activity_send_summary();
+      break;
+    case WORKER_UNWATCH:
+      s_watched = false;
+      break;
+  }
+}
+
+static void worker_init(void) {
+  s_active_s = persist_exists(PERSIST_ACTIVE_TIME) ? persist_read_int(PERSIST_ACTIVE_TIME) : 0;
+  s_saved_time = time(NULL);
+  if (persist_exists(PERSIST_ACTIVITY_RATES)) {
+    uint32_t rates = persist_read_int(PERSIST_ACTIVITY_RATES);
+    if ((rates & 0xFF) && (rates >> 8 & 0xFF)) {
+      s_still_rate = rates & 0xFF;
+      s_moving_rate = rates >> 8 & 0xFF;
+    }
+  }
+  s_rate = s_still_rate;
+  history_load();
+  app_worker_message_subscribe(activity_message_handler);
+  accel_data_service_subscribe(ACCEL_BATCH_SIZE, accel_handler);
+  accel_service_set_sampling_rate(s_rate);
+  // Tells the app, which may have been launched before the worker, that it
+  // can send its rates now (activity.h)
+  activity_send_totals();
+  activity_send_summary();
+}
+
+static void worker_deinit(void) {
+  accel_data_service_unsubscribe();
+  app_worker_message_unsubscribe();
+  activity_save();
+}
+
+int main(void) {
+  worker_init();
+  worker_event_loop();
+  worker_deinit();
+  return 0;
+}